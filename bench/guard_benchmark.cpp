@@ -0,0 +1,147 @@
+// Microbenchmarks for the Guard hot paths. Run on the host:
+//
+//   bazel run -c opt //:roo_powersafefs_benchmark
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "roo_powersafefs.h"
+
+namespace roo_powersafefs {
+namespace {
+
+using std::chrono::microseconds;
+
+// Device with configurable mount and unmount latency.
+class FakeDevice : public Device {
+ public:
+  FakeDevice(microseconds mount_latency = microseconds(0),
+             microseconds unmount_latency = microseconds(0))
+      : mount_latency_(mount_latency),
+        unmount_latency_(unmount_latency),
+        mounts_(0),
+        unmounts_(0) {}
+
+  bool mount() override {
+    if (mount_latency_.count() > 0) std::this_thread::sleep_for(mount_latency_);
+    ++mounts_;
+    return true;
+  }
+
+  void unmount() override {
+    if (unmount_latency_.count() > 0) {
+      std::this_thread::sleep_for(unmount_latency_);
+    }
+    ++unmounts_;
+  }
+
+  int mounts() const { return mounts_; }
+  int unmounts() const { return unmounts_; }
+
+ private:
+  microseconds mount_latency_;
+  microseconds unmount_latency_;
+  std::atomic<int> mounts_;
+  std::atomic<int> unmounts_;
+};
+
+// Runs op(iterations) in each of the threads, and reports the average time
+// per operation (in wall time, over all threads).
+void Run(const char* name, int threads, long iterations,
+         std::function<void(long)> op) {
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back([&]() {
+      ++ready;
+      while (!go) {
+      }
+      op(iterations);
+    });
+  }
+  while (ready < threads) {
+  }
+  Clock::time_point start = Clock::now();
+  go = true;
+  for (std::thread& worker : workers) worker.join();
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+  printf("%-40s threads=%-2d %10.1f ns/op\n", name, threads,
+         ns / (iterations * threads));
+}
+
+void BenchmarkMount(int threads) {
+  FakeDevice device;
+  Guard guard(&device);
+  Mount holder(&guard);
+  Run("Mount acquire/release", threads, 1000000, [&](long n) {
+    for (long i = 0; i < n; ++i) {
+      Mount mount(&guard);
+    }
+  });
+}
+
+void BenchmarkWriteTransaction(int threads) {
+  FakeDevice device;
+  Guard guard(&device);
+  Mount holder(&guard);
+  Run("WriteTransaction begin/end", threads, 500000, [&](long n) {
+    for (long i = 0; i < n; ++i) {
+      WriteTransaction write(&guard);
+    }
+  });
+}
+
+void BenchmarkSetModeChurn(int threads) {
+  FakeDevice device;
+  Guard guard(&device);
+  std::atomic<int> next_id(0);
+  Run("setMode() churn with readers", threads, 200000, [&](long n) {
+    if (next_id++ == 0) {
+      // The first thread flips modes, the others take mounts.
+      for (long i = 0; i < n; ++i) {
+        guard.setMode(i % 2 == 0 ? Guard::FS_EAGER_UNMOUNT : Guard::FS_NORMAL);
+      }
+    } else {
+      for (long i = 0; i < n; ++i) {
+        Mount mount(&guard);
+      }
+    }
+  });
+}
+
+void BenchmarkEagerUnmountThrash(microseconds unmount_delay) {
+  FakeDevice device(microseconds(200), microseconds(100));
+  Guard guard(&device);
+  guard.setMode(Guard::FS_EAGER_UNMOUNT);
+  guard.setUnmountDelay(unmount_delay);
+  char name[64];
+  snprintf(name, sizeof(name), "FS_EAGER_UNMOUNT thrash, delay=%ldus",
+           (long)unmount_delay.count());
+  Run(name, 1, 2000, [&](long n) {
+    for (long i = 0; i < n; ++i) {
+      Mount mount(&guard);
+      guard.tick();
+    }
+  });
+  printf("%-40s device mounts=%d unmounts=%d\n", "", device.mounts(),
+         device.unmounts());
+}
+
+}  // namespace
+}  // namespace roo_powersafefs
+
+int main() {
+  using namespace roo_powersafefs;
+  for (int threads : {1, 2, 4, 8}) BenchmarkMount(threads);
+  for (int threads : {1, 2, 4, 8}) BenchmarkWriteTransaction(threads);
+  for (int threads : {2, 4}) BenchmarkSetModeChurn(threads);
+  BenchmarkEagerUnmountThrash(std::chrono::microseconds(0));
+  BenchmarkEagerUnmountThrash(std::chrono::milliseconds(10));
+  return 0;
+}
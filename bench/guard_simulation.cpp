@@ -0,0 +1,437 @@
+// Host-side simulation of a Guard under a multi-threaded workload, with
+// power cuts injected at random points. Used for tuning mode policies. Run
+// on the host:
+//
+//   bazel run -c opt //:roo_powersafefs_simulation
+//
+// Each scenario runs a number of power cycles. In each cycle, a fresh guard
+// over a simulated device serves writer and reader threads, until the power
+// is cut at a random time. If the scenario has a warning lead time (e.g. a
+// brownout detector), the guard is drained for that long before the cut.
+// At each cut, the simulation records the write transactions that were
+// still in flight, i.e. the writes at risk. Reports throughput, tail
+// latency of the writes, and the device mount count.
+//
+// With --check (as run by the roo_powersafefs_simulation_test target), runs
+// fewer cycles, and exits with a non-zero status if any invariant breaks:
+// the device is mounted when already mounted or unmounted when already
+// unmounted; in scenarios with a warning, drain() fails, or a write is in
+// flight or torn at the cut; Mount objects are left after all the threads
+// have finished; or the mode seen by the listener differs from the guard's
+// (e.g. when the guard has degraded on a failing card).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "roo_powersafefs.h"
+
+namespace roo_powersafefs {
+namespace {
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+// Device with realistic latencies, whose power can be cut. Without power,
+// mounts fail, and writes in progress are torn.
+class SimulatedDevice : public Device {
+ public:
+  SimulatedDevice(microseconds mount_latency, microseconds unmount_latency,
+                  microseconds write_latency_per_kb, int mount_failure_percent,
+                  unsigned seed)
+      : mount_latency_(mount_latency),
+        unmount_latency_(unmount_latency),
+        write_latency_per_kb_(write_latency_per_kb),
+        mount_failure_percent_(mount_failure_percent),
+        rng_(seed),
+        powered_(true),
+        mounted_(false),
+        mounts_(0),
+        torn_writes_(0),
+        double_mounts_(0),
+        double_unmounts_(0) {}
+
+  bool mount() override {
+    std::this_thread::sleep_for(mount_latency_);
+    if (!powered_) return false;
+    // The guard never calls mount() concurrently, so the rng is safe.
+    if (std::uniform_int_distribution<int>(0, 99)(rng_) <
+        mount_failure_percent_) {
+      return false;
+    }
+    if (mounted_) ++double_mounts_;
+    ++mounts_;
+    mounted_ = true;
+    return true;
+  }
+
+  void unmount() override {
+    if (!powered_) return;
+    if (!mounted_) ++double_unmounts_;
+    std::this_thread::sleep_for(unmount_latency_);
+    mounted_ = false;
+  }
+
+  // Writes in 1 KB chunks, so that a power cut can tear the write.
+  bool write(size_t size) {
+    for (size_t done = 0; done < size; done += 1024) {
+      if (!powered_ || !mounted_) {
+        if (done > 0) ++torn_writes_;
+        return false;
+      }
+      size_t chunk = std::min<size_t>(1024, size - done);
+      std::this_thread::sleep_for(write_latency_per_kb_ * chunk / 1024);
+    }
+    return powered_;
+  }
+
+  void cutPower() { powered_ = false; }
+
+  bool mounted() const { return mounted_; }
+
+  int mounts() const { return mounts_; }
+  int tornWrites() const { return torn_writes_; }
+  int doubleMounts() const { return double_mounts_; }
+  int doubleUnmounts() const { return double_unmounts_; }
+
+ private:
+  microseconds mount_latency_;
+  microseconds unmount_latency_;
+  microseconds write_latency_per_kb_;
+  int mount_failure_percent_;
+  std::mt19937 rng_;
+  std::atomic<bool> powered_;
+  std::atomic<bool> mounted_;
+  std::atomic<int> mounts_;
+  std::atomic<int> torn_writes_;
+  std::atomic<int> double_mounts_;
+  std::atomic<int> double_unmounts_;
+};
+
+// Keeps the mode as last reported to the listener.
+class ModeListener : public Guard::Listener {
+ public:
+  explicit ModeListener(Guard::Mode mode) : mode_(mode) {}
+
+  void onModeChanged(Guard& guard, Guard::Mode mode) override {
+    mode_ = mode;
+  }
+
+  Guard::Mode mode() const { return mode_; }
+
+ private:
+  std::atomic<Guard::Mode> mode_;
+};
+
+class SimulatedFile : public WriteTarget {
+ public:
+  SimulatedFile(SimulatedDevice* device) : device_(device) {}
+
+  bool write(const uint8_t* data, size_t size) override {
+    return device_->write(size);
+  }
+
+ private:
+  SimulatedDevice* device_;
+};
+
+struct Scenario {
+  const char* name;
+  Guard::Mode mode;
+  microseconds unmount_delay;
+
+  // Zero if the power cuts come without warning.
+  microseconds warning;
+
+  // Percentage of the device mounts that fail, e.g. on a dying card. If
+  // non-zero, the guard is set up to degrade on unhealthy media.
+  int mount_failure_percent;
+
+  // If set, a single writer, and no readers or ticks, so that nobody else
+  // can deliver the events: each request must deliver the events it has
+  // caused (e.g. a mode change on degrading) by the time it returns, which
+  // the writer checks.
+  bool serial;
+};
+
+struct Workload {
+  int writers;
+  int readers;
+
+  // Mean time between consecutive requests of a single thread.
+  microseconds think_time;
+
+  // Write sizes are uniformly distributed in [1, max_write_size].
+  size_t max_write_size;
+
+  // Each cycle lasts a random time in [min_cycle, max_cycle].
+  milliseconds min_cycle;
+  milliseconds max_cycle;
+  int cycles;
+};
+
+struct Results {
+  long writes = 0;
+  long failed_writes = 0;
+  long rejected_writes = 0;
+  long reads = 0;
+  uint64_t bytes = 0;
+  int mounts = 0;
+  int torn_writes = 0;
+  int mounted_at_cut = 0;
+  int degraded = 0;
+  Clock::duration run_time = Clock::duration(0);
+  std::vector<uint32_t> write_latencies_us;
+  std::vector<int> in_flight_at_cut;
+  int violations = 0;
+};
+
+struct ThreadResults {
+  long writes = 0;
+  long failed_writes = 0;
+  long rejected_writes = 0;
+  long reads = 0;
+  uint64_t bytes = 0;
+  std::vector<uint32_t> write_latencies_us;
+  int unreported_mode_changes = 0;
+};
+
+void Think(std::mt19937& rng, microseconds mean) {
+  std::exponential_distribution<double> think(1.0 / mean.count());
+  std::this_thread::sleep_for(microseconds((long)think(rng)));
+}
+
+// If listener is not null, checks that it has been told about the current
+// mode after every request.
+void Writer(Guard& guard, SimulatedDevice& device, const Workload& workload,
+            const ModeListener* listener, unsigned seed,
+            const std::atomic<bool>& stop, ThreadResults& results) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<size_t> size(1, workload.max_write_size);
+  SimulatedFile file(&device);
+  std::vector<uint8_t> data(workload.max_write_size);
+  while (!stop) {
+    size_t n = size(rng);
+    Clock::time_point start = Clock::now();
+    WriteMount write = guard.mountForWrite();
+    if (!write.active()) {
+      ++results.rejected_writes;
+    } else if (write.write(&file, data.data(), n)) {
+      ++results.writes;
+      results.bytes += n;
+      results.write_latencies_us.push_back(
+          (uint32_t)std::chrono::duration_cast<microseconds>(Clock::now() -
+                                                             start)
+              .count());
+    } else {
+      ++results.failed_writes;
+    }
+    write.reset();
+    if (listener != nullptr && listener->mode() != guard.mode()) {
+      ++results.unreported_mode_changes;
+    }
+    Think(rng, workload.think_time);
+  }
+}
+
+void Reader(Guard& guard, const Workload& workload, unsigned seed,
+            const std::atomic<bool>& stop, ThreadResults& results) {
+  std::mt19937 rng(seed);
+  while (!stop) {
+    {
+      Mount mount(&guard);
+      if (mount.mounted()) {
+        ++results.reads;
+        std::this_thread::sleep_for(microseconds(100));
+      }
+    }
+    Think(rng, workload.think_time);
+  }
+}
+
+// Reports a broken invariant.
+void Violation(Results& results, int cycle, const char* what) {
+  printf("  VIOLATION in cycle %d: %s\n", cycle, what);
+  ++results.violations;
+}
+
+// Runs a single power cycle, accumulating the results.
+void RunCycle(const Scenario& scenario, const Workload& workload,
+              std::mt19937& rng, Results& results) {
+  SimulatedDevice device(milliseconds(20), milliseconds(5), microseconds(200),
+                         scenario.mount_failure_percent, rng());
+  Guard guard(&device);
+  guard.setMode(scenario.mode);
+  guard.setUnmountDelay(scenario.unmount_delay);
+  ModeListener listener(scenario.mode);
+  guard.setListener(&listener);
+  if (scenario.mount_failure_percent > 0) {
+    HealthThresholds thresholds;
+    thresholds.min_samples = 4;
+    guard.setHealthThresholds(thresholds);
+  }
+  std::atomic<bool> stop(false);
+  int writers = scenario.serial ? 1 : workload.writers;
+  int threads = scenario.serial ? 1 : workload.writers + workload.readers;
+  std::vector<ThreadResults> thread_results(threads);
+  std::vector<std::thread> workers;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < threads; ++i) {
+    unsigned seed = rng();
+    if (i < writers) {
+      workers.emplace_back([&, i, seed]() {
+        Writer(guard, device, workload, scenario.serial ? &listener : nullptr,
+               seed, stop, thread_results[i]);
+      });
+    } else {
+      workers.emplace_back([&, i, seed]() {
+        Reader(guard, workload, seed, stop, thread_results[i]);
+      });
+    }
+  }
+  std::uniform_int_distribution<long> cycle(workload.min_cycle.count(),
+                                            workload.max_cycle.count());
+  Clock::time_point cut = start + milliseconds(cycle(rng));
+  Clock::time_point warning = cut - scenario.warning;
+  int cycle_index = (int)results.in_flight_at_cut.size();
+  bool drained = true;
+  while (Clock::now() < cut) {
+    if (!scenario.serial) guard.tick();
+    if (scenario.warning.count() > 0 && Clock::now() >= warning) {
+      drained = guard.drain(cut);
+      std::this_thread::sleep_until(cut);
+      break;
+    }
+    std::this_thread::sleep_for(milliseconds(1));
+  }
+  int in_flight = guard.getPendingWriteTransactionsCount();
+  results.in_flight_at_cut.push_back(in_flight);
+  if (device.mounted()) ++results.mounted_at_cut;
+  int torn_before_cut = device.tornWrites();
+  device.cutPower();
+  results.run_time += Clock::now() - start;
+  stop = true;
+  for (std::thread& worker : workers) worker.join();
+  if (scenario.warning.count() > 0) {
+    if (!drained) Violation(results, cycle_index, "drain() failed");
+    if (in_flight > 0) {
+      Violation(results, cycle_index, "write in flight at the cut");
+    }
+    // Writes torn before the cut have nothing to do with the warning.
+    if (device.tornWrites() > torn_before_cut) {
+      Violation(results, cycle_index, "write torn at the cut");
+    }
+  }
+  if (device.doubleMounts() > 0) {
+    Violation(results, cycle_index, "mounted when already mounted");
+  }
+  if (device.doubleUnmounts() > 0) {
+    Violation(results, cycle_index, "unmounted when already unmounted");
+  }
+  if (guard.getPendingMountsCount() != 0) {
+    Violation(results, cycle_index, "Mount objects left after the threads");
+  }
+  int unreported_mode_changes = 0;
+  for (const ThreadResults& r : thread_results) {
+    unreported_mode_changes += r.unreported_mode_changes;
+  }
+  if (unreported_mode_changes > 0 || listener.mode() != guard.mode()) {
+    Violation(results, cycle_index, "mode change not reported");
+  }
+  if (guard.baseMode() == Guard::FS_LAME_DUCK) ++results.degraded;
+  guard.setListener(nullptr);
+  for (const ThreadResults& r : thread_results) {
+    results.writes += r.writes;
+    results.failed_writes += r.failed_writes;
+    results.rejected_writes += r.rejected_writes;
+    results.reads += r.reads;
+    results.bytes += r.bytes;
+    results.write_latencies_us.insert(results.write_latencies_us.end(),
+                                      r.write_latencies_us.begin(),
+                                      r.write_latencies_us.end());
+  }
+  results.mounts += device.mounts();
+  results.torn_writes += device.tornWrites();
+}
+
+uint32_t Percentile(const std::vector<uint32_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = (size_t)(p * (sorted.size() - 1));
+  return sorted[i];
+}
+
+// Returns the number of broken invariants.
+int Simulate(const Scenario& scenario, const Workload& workload) {
+  std::mt19937 rng(12345);
+  Results results;
+  for (int i = 0; i < workload.cycles; ++i) {
+    RunCycle(scenario, workload, rng, results);
+  }
+  std::sort(results.write_latencies_us.begin(),
+            results.write_latencies_us.end());
+  double seconds = std::chrono::duration<double>(results.run_time).count();
+  printf("%s\n", scenario.name);
+  printf("  throughput:    %.0f writes/s, %.1f KB/s, %.0f reads/s\n",
+         results.writes / seconds, results.bytes / 1024.0 / seconds,
+         results.reads / seconds);
+  printf("  write latency: p50=%uus p99=%uus p99.9=%uus max=%uus\n",
+         Percentile(results.write_latencies_us, 0.5),
+         Percentile(results.write_latencies_us, 0.99),
+         Percentile(results.write_latencies_us, 0.999),
+         Percentile(results.write_latencies_us, 1.0));
+  printf("  writes:        ok=%ld failed=%ld rejected=%ld torn=%d\n",
+         results.writes, results.failed_writes, results.rejected_writes,
+         results.torn_writes);
+  printf("  device mounts: %d (%.1f per cycle), mounted at cut: %d/%d\n",
+         results.mounts, (double)results.mounts / workload.cycles,
+         results.mounted_at_cut, workload.cycles);
+  if (scenario.mount_failure_percent > 0) {
+    printf("  degraded:      %d/%d cycles\n", results.degraded,
+           workload.cycles);
+  }
+  printf("  in flight at each cut:");
+  for (int in_flight : results.in_flight_at_cut) printf(" %d", in_flight);
+  printf("\n");
+  return results.violations;
+}
+
+}  // namespace
+}  // namespace roo_powersafefs
+
+int main(int argc, char** argv) {
+  using namespace roo_powersafefs;
+  bool check = (argc > 1 && strcmp(argv[1], "--check") == 0);
+  Workload workload;
+  workload.writers = 4;
+  workload.readers = 2;
+  workload.think_time = milliseconds(5);
+  workload.max_write_size = 4096;
+  workload.min_cycle = milliseconds(100);
+  workload.max_cycle = milliseconds(300);
+  workload.cycles = check ? 3 : 10;
+  const Scenario scenarios[] = {
+      {"FS_NORMAL, no warning", Guard::FS_NORMAL, microseconds(0),
+       microseconds(0), 0, false},
+      {"FS_EAGER_UNMOUNT, no warning", Guard::FS_EAGER_UNMOUNT,
+       microseconds(0), microseconds(0), 0, false},
+      {"FS_EAGER_UNMOUNT, 20ms unmount delay, no warning",
+       Guard::FS_EAGER_UNMOUNT, milliseconds(20), microseconds(0), 0, false},
+      {"FS_NORMAL, 20ms warning", Guard::FS_NORMAL, microseconds(0),
+       milliseconds(20), 0, false},
+      {"FS_EAGER_UNMOUNT, failing card", Guard::FS_EAGER_UNMOUNT,
+       microseconds(0), microseconds(0), 60, true},
+  };
+  int violations = 0;
+  for (const Scenario& scenario : scenarios) {
+    violations += Simulate(scenario, workload);
+  }
+  if (!check) return 0;
+  printf("%d violation(s)\n", violations);
+  return violations == 0 ? 0 : 1;
+}
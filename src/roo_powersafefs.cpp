@@ -1,100 +1,841 @@
 #include "roo_powersafefs.h"
 
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#if ROO_POWERSAFEFS_SYNC != ROO_POWERSAFEFS_SYNC_NONE
+#include <thread>
+#endif
+
+#if ROO_POWERSAFEFS_STATS
+#define POWERSAFEFS_STAT(stmt) stmt
+#else
+#define POWERSAFEFS_STAT(stmt)
+#endif
+
 namespace roo_powersafefs {
 
+Mount::Mount() : guard_(nullptr), forced_(false), mounted_(false) {}
+
 Mount::Mount(Guard* guard, bool forced)
     : guard_(guard), forced_(forced), mounted_(guard_->tryMount(forced)) {}
 
-Mount::~Mount() {
+Mount::~Mount() { reset(); }
+
+void Mount::reset() {
   if (mounted_) {
+    mounted_ = false;
     guard_->unmount(forced_);
   }
 }
 
+Mount::Mount(Guard* guard, bool forced, bool mounted)
+    : guard_(guard), forced_(forced), mounted_(mounted) {}
+
 Mount::Mount(Mount&& other)
     : guard_(other.guard_), forced_(other.forced_), mounted_(other.mounted_) {
   other.mounted_ = false;
 }
 
+Mount& Mount::operator=(Mount&& other) {
+  if (this != &other) {
+    reset();
+    guard_ = other.guard_;
+    forced_ = other.forced_;
+    mounted_ = other.mounted_;
+    other.mounted_ = false;
+  }
+  return *this;
+}
+
+WriteMount& WriteMount::operator=(WriteMount&& other) {
+  if (this != &other) {
+    reset();
+    mount_ = std::move(other.mount_);
+    transaction_ = std::move(other.transaction_);
+  }
+  return *this;
+}
+
+void WriteMount::reset() {
+  if (!transaction_.active_ || !mount_.mounted_) {
+    transaction_.reset();
+    mount_.reset();
+    return;
+  }
+  transaction_.active_ = false;
+  mount_.mounted_ = false;
+  POWERSAFEFS_STAT(transaction_.guard_->stats_.recordWriteTransactionDuration(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - transaction_.start_)));
+  transaction_.guard_->endWriteTransactionAndUnmount(transaction_.priority_,
+                                                     transaction_.forced_);
+}
+
+ModeOverride::ModeOverride(Guard* guard, Guard::Mode mode)
+    : guard_(guard), mode_(mode), prev_(nullptr), next_(nullptr) {
+  guard_->addModeOverride(this);
+}
+
+ModeOverride::~ModeOverride() { guard_->removeModeOverride(this); }
+
+struct SharedMount::Shared {
+  explicit Shared(Mount&& mount) : mount(std::move(mount)), refs(1) {}
+
+  Mount mount;
+  std::atomic<int> refs;
+};
+
+SharedMount::SharedMount(Mount&& mount)
+    : shared_(mount.mounted() ? new Shared(std::move(mount)) : nullptr) {}
+
+SharedMount::SharedMount(const SharedMount& other) : shared_(other.shared_) {
+  if (shared_ != nullptr) shared_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+SharedMount& SharedMount::operator=(const SharedMount& other) {
+  if (shared_ != other.shared_) {
+    reset();
+    shared_ = other.shared_;
+    if (shared_ != nullptr) {
+      shared_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  return *this;
+}
+
+SharedMount& SharedMount::operator=(SharedMount&& other) {
+  if (this != &other) {
+    reset();
+    shared_ = other.shared_;
+    other.shared_ = nullptr;
+  }
+  return *this;
+}
+
+void SharedMount::reset() {
+  if (shared_ == nullptr) return;
+  if (shared_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    // The last reference; releases the mount.
+    delete shared_;
+  }
+  shared_ = nullptr;
+}
+
+WriteTransaction::WriteTransaction()
+    : guard_(nullptr),
+      priority_(WRITE_PRIORITY_NORMAL),
+      forced_(false),
+      epoch_(0),
+      active_(false) {}
+
 WriteTransaction::WriteTransaction(Guard* guard, bool forced)
+    : WriteTransaction(guard, WRITE_PRIORITY_NORMAL, forced) {}
+
+WriteTransaction::WriteTransaction(Guard* guard, WritePriority priority,
+                                   bool forced)
+    : guard_(guard),
+      priority_(priority),
+      forced_(forced),
+      // Read before admission, so that an abort requested concurrently with
+      // the admission is not missed.
+      epoch_(guard_->abort_epoch_.load(std::memory_order_acquire)),
+      active_(guard_->tryBeginWriteTransaction(priority, forced)) {
+  guard_->trace(active_ ? TRACE_WRITE_BEGIN : TRACE_WRITE_REJECTED, priority);
+  POWERSAFEFS_STAT(if (active_) start_ = Clock::now());
+}
+
+WriteTransaction::WriteTransaction(Guard* guard, WritePriority priority,
+                                   bool forced, uint32_t epoch, bool active)
     : guard_(guard),
+      priority_(priority),
       forced_(forced),
-      active_(guard_->tryBeginWriteTransaction(forced)) {}
+      epoch_(epoch),
+      active_(active) {
+  POWERSAFEFS_STAT(if (active_) start_ = Clock::now());
+}
 
 WriteTransaction::WriteTransaction(WriteTransaction&& other)
-    : guard_(other.guard_), forced_(other.forced_), active_(other.active_) {
+    : guard_(other.guard_),
+      priority_(other.priority_),
+      forced_(other.forced_),
+      epoch_(other.epoch_),
+      active_(other.active_) {
+  POWERSAFEFS_STAT(start_ = other.start_);
   other.active_ = false;
 }
 
-WriteTransaction::~WriteTransaction() {
+WriteTransaction& WriteTransaction::operator=(WriteTransaction&& other) {
+  if (this != &other) {
+    reset();
+    guard_ = other.guard_;
+    priority_ = other.priority_;
+    forced_ = other.forced_;
+    epoch_ = other.epoch_;
+    active_ = other.active_;
+    POWERSAFEFS_STAT(start_ = other.start_);
+    other.active_ = false;
+  }
+  return *this;
+}
+
+bool WriteTransaction::write(WriteTarget* target, const void* data,
+                             size_t size) {
+  reportBytesWritten(size);
+  if (guard_->write_back_ != nullptr) {
+    return guard_->write_back_->write(target, data, size);
+  }
+  return target->write((const uint8_t*)data, size);
+}
+
+void WriteTransaction::reportBytesWritten(size_t bytes) {
+  guard_->write_budget_spent_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+bool WriteTransaction::shouldAbort() const {
+  return active_ &&
+         guard_->abort_epoch_.load(std::memory_order_acquire) != epoch_;
+}
+
+WriteTransaction::~WriteTransaction() { reset(); }
+
+void WriteTransaction::reset() {
   if (active_) {
-    guard_->endWriteTransaction(forced_);
+    active_ = false;
+    POWERSAFEFS_STAT(guard_->stats_.recordWriteTransactionDuration(
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                              start_)));
+    guard_->endWriteTransaction(priority_, forced_);
+  }
+}
+
+WriteBatch::WriteBatch(Guard* guard, WritePriority priority, bool forced)
+    : transaction_(guard, priority, forced) {}
+
+namespace {
+
+// Layout of Guard::state_.
+constexpr uint32_t kModeMask = 0x7;
+constexpr int kMountStateShift = 3;
+constexpr uint32_t kMountStateMask = 0x3 << kMountStateShift;
+constexpr uint32_t kReadOnlyBit = 0x20;
+// Set by the lock-free mount path, and cleared by maybeMaintain(), which
+// takes it as activity.
+constexpr uint32_t kActivityBit = 0x40;
+constexpr int kMountCountShift = 8;
+constexpr uint32_t kMountCountOne = 1 << kMountCountShift;
+
+inline Guard::Mode GetMode(uint32_t state) {
+  return (Guard::Mode)(state & kModeMask);
+}
+
+inline Guard::MountState GetMountState(uint32_t state) {
+  return (Guard::MountState)((state & kMountStateMask) >> kMountStateShift);
+}
+
+inline bool IsMounted(uint32_t state) {
+  return GetMountState(state) == Guard::FS_MOUNTED;
+}
+
+inline bool IsTransitional(uint32_t state) {
+  return GetMountState(state) == Guard::FS_MOUNTING ||
+         GetMountState(state) == Guard::FS_UNMOUNTING;
+}
+
+inline int GetMountCount(uint32_t state) {
+  return (int)(state >> kMountCountShift);
+}
+
+inline uint32_t WithMode(uint32_t state, Guard::Mode mode) {
+  return (state & ~kModeMask) | (uint32_t)mode;
+}
+
+inline uint32_t WithMountState(uint32_t state, Guard::MountState mount_state) {
+  return (state & ~kMountStateMask) |
+         ((uint32_t)mount_state << kMountStateShift);
+}
+
+void DefaultExecutor(std::function<void()> task) {
+#if ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_NONE
+  task();
+#else
+  std::thread(std::move(task)).detach();
+#endif
+}
+
+// Whether new mount and write transaction requests are granted in the
+// specified mode.
+inline bool Admits(Guard::Mode mode, bool forced) {
+  switch (mode) {
+    case Guard::FS_DISABLED:
+    case Guard::FS_SHUTDOWN: {
+      return false;
+    }
+    case Guard::FS_LAME_DUCK: {
+      return forced;
+    }
+    case Guard::FS_NORMAL:
+    case Guard::FS_EAGER_UNMOUNT:
+    default: {
+      return true;
+    }
   }
 }
 
+}  // namespace
+
+bool WriteBatch::windDownRequested() const {
+  return active() &&
+         !Admits(transaction_.guard_->mode(), transaction_.forced_);
+}
+
+bool MaintenanceBudget::shouldYield() const {
+  uint32_t state = guard_->state_.load(std::memory_order_acquire);
+  if (GetMountCount(state) > 0 || GetMode(state) != Guard::FS_NORMAL) {
+    return true;
+  }
+  if (guard_->write_transaction_count_.load(std::memory_order_acquire) > 0) {
+    return true;
+  }
+  return Clock::now() >= deadline_;
+}
+
 Guard::Guard(Device* device)
     : device_(device),
-      mode_(FS_NORMAL),
-      mounted_(false),
-      mount_count_(0),
+      state_(WithMountState(FS_NORMAL, FS_UNMOUNTED)),
+      base_mode_(FS_NORMAL),
+      mode_overrides_(nullptr),
+      mount_failures_(0),
+      initial_retry_delay_(std::chrono::milliseconds(10)),
+      max_retry_delay_(std::chrono::seconds(1)),
+      retry_delay_(0),
+      next_mount_retry_(Clock::time_point::min()),
+      min_unmount_delay_(0),
+      max_unmount_delay_(0),
+      avg_idle_time_(0),
+      idle_since_(Clock::time_point::min()),
+      unmount_not_before_(Clock::time_point::min()),
+      executor_(DefaultExecutor),
+      async_mount_scheduled_(false),
+      deferred_unmount_(false),
+      deferred_unmount_scheduled_(false),
+      upgrading_(false),
+      maintenance_idle_threshold_(0),
+      maintenance_budget_(0),
+      last_activity_(Clock::time_point::min()),
+      maintenance_done_(false),
+      maintaining_(false),
+      listener_(nullptr),
+      trace_(nullptr),
+      persistent_state_(nullptr),
+      clean_hint_pending_(false),
+      dispatching_events_(false),
+      write_back_flushes_(0),
+      health_tracking_(false),
+      health_degraded_(false),
       forced_mount_count_(0),
       write_transaction_count_(0),
-      forced_write_transaction_count_(0) {}
+      forced_write_transaction_count_(0),
+      abort_epoch_(0),
+      min_write_priority_(WRITE_PRIORITY_LOW),
+      write_budget_rate_(0),
+      write_budget_burst_(0),
+      write_budget_tokens_(0),
+      write_budget_spent_(0) {
+  for (int i = 0; i < kWritePriorityCount; ++i) {
+    write_quota_[i] = -1;
+    write_transaction_count_by_priority_[i] = 0;
+    supply_thresholds_[i] = std::numeric_limits<int>::min();
+  }
+}
 
 Guard::Mode Guard::mode() const {
-  std::lock_guard<std::mutex> guard(mutex_);
-  return mode_;
+  return GetMode(state_.load(std::memory_order_acquire));
 }
 
-void Guard::unmountIfPending() {
-  if (mounted_ && mount_count_ == 0) {
-    device_->unmount();
-    mounted_ = false;
+Guard::Mode Guard::baseMode() const {
+  std::lock_guard<Mutex> guard(mutex_);
+  return base_mode_;
+}
+
+Guard::MountState Guard::mountState() const {
+  return GetMountState(state_.load(std::memory_order_acquire));
+}
+
+bool Guard::isMountedReadOnly() const {
+  uint32_t state = state_.load(std::memory_order_acquire);
+  return IsMounted(state) && (state & kReadOnlyBit) != 0;
+}
+
+void Guard::setReadOnly(bool read_only) {
+  if (read_only) {
+    state_.fetch_or(kReadOnlyBit, std::memory_order_release);
+  } else {
+    state_.fetch_and(~kReadOnlyBit, std::memory_order_release);
   }
 }
 
-void Guard::setMode(Guard::Mode mode) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  if (mode == mode_) return;
-  switch (mode_) {
+void Guard::setMountState(MountState mount_state) {
+  uint32_t state = state_.load(std::memory_order_relaxed);
+  while (!state_.compare_exchange_weak(state,
+                                       WithMountState(state, mount_state),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+  }
+}
+
+bool Guard::shouldUnmount(uint32_t state) const {
+  // Whoever is upgrading or maintaining the mount reconciles when done.
+  if (upgrading_ || maintaining_) return false;
+  switch (GetMode(state)) {
+    case FS_NORMAL: {
+      return false;
+    }
+    case FS_DISABLED: {
+      // Unmount even if in use.
+      return true;
+    }
     case FS_EAGER_UNMOUNT: {
-      unmountIfPending();
-      // No break.
+      return GetMountCount(state) == 0 && Clock::now() >= unmount_not_before_;
     }
-    case FS_NORMAL: {
-      if (!mounted_ && mount_count_ > 0) {
-        // Need to re-mount.
-        mounted_ = device_->mount();
-      }
-      break;
+    case FS_LAME_DUCK:
+    case FS_SHUTDOWN:
+    default: {
+      return GetMountCount(state) == 0;
+    }
+  }
+}
+
+bool Guard::shouldRemount(uint32_t state) const {
+  // Mount objects may outlive the device being mounted only across
+  // FS_DISABLED.
+  switch (GetMode(state)) {
+    case FS_NORMAL:
+    case FS_EAGER_UNMOUNT: {
+      return GetMountCount(state) > 0;
     }
     case FS_LAME_DUCK: {
-      if (!mounted_ && forced_mount_count_ > 0) {
-        // Need to re-mount.
-        mounted_ = device_->mount();
+      return forced_mount_count_ > 0;
+    }
+    case FS_SHUTDOWN:
+    case FS_DISABLED:
+    default: {
+      return false;
+    }
+  }
+}
+
+bool Guard::deviceMount(std::unique_lock<Mutex>& lock) {
+  setMountState(FS_MOUNTING);
+  // Mount read-write directly if write transactions have outlived the
+  // device being mounted (across FS_DISABLED).
+  bool read_only =
+      device_->supportsReadOnlyMount() &&
+      write_transaction_count_.load(std::memory_order_relaxed) == 0;
+  PersistentState* persistent_state = persistent_state_;
+  bool clean_hint = clean_hint_pending_;
+  clean_hint_pending_ = false;
+  lock.unlock();
+  if (persistent_state != nullptr) {
+    if (clean_hint) device_->setLastUnmountClean(persistent_state->clean());
+    persistent_state->markDirty();
+  }
+  trace(TRACE_DEVICE_MOUNT_BEGIN, 0);
+  Clock::time_point start = Clock::now();
+  bool mounted = read_only ? device_->mountReadOnly() : device_->mount();
+  trace(TRACE_DEVICE_MOUNT_END, (mounted ? 1 : 0) | (read_only ? 2 : 0));
+  POWERSAFEFS_STAT(stats_.recordDeviceMountLatency(
+      std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                            start)));
+  POWERSAFEFS_STAT(if (!mounted) stats_.countMountFailure());
+  lock.lock();
+  recordDeviceCall(start, mounted);
+  if (mounted) {
+    retry_delay_ = std::chrono::microseconds(0);
+    next_mount_retry_ = Clock::time_point::min();
+  } else {
+    ++mount_failures_;
+    retry_delay_ = retry_delay_.count() == 0
+                       ? initial_retry_delay_
+                       : std::min(2 * retry_delay_, max_retry_delay_);
+    next_mount_retry_ = Clock::now() + retry_delay_;
+  }
+  setReadOnly(mounted && read_only);
+  setMountState(mounted ? FS_MOUNTED : FS_UNMOUNTED);
+  transition_cv_.notify_all();
+  if (mounted) postEvent(EVENT_MOUNTED);
+  return mounted;
+}
+
+void Guard::recordDeviceCall(Clock::time_point start, bool ok) {
+  health_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                     Clock::now() - start),
+                 ok);
+  if (!health_tracking_ || health_degraded_) return;
+  if (!health_.exceeds(health_thresholds_)) return;
+  if (base_mode_ != FS_NORMAL && base_mode_ != FS_EAGER_UNMOUNT) return;
+  // Keeps the samples, so that healthScore() still tells why.
+  setModeLocked(FS_LAME_DUCK);
+  health_degraded_ = true;
+}
+
+bool Guard::beginUnmount() {
+  uint32_t state = state_.load(std::memory_order_acquire);
+  while (IsMounted(state) && shouldUnmount(state)) {
+    if (state_.compare_exchange_weak(state,
+                                     WithMountState(state, FS_UNMOUNTING),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Guard::finishUnmount(std::unique_lock<Mutex>& lock) {
+  lock.unlock();
+  if (write_back_ != nullptr) write_back_->flushRetainingErrors();
+  trace(TRACE_DEVICE_UNMOUNT_BEGIN, 0);
+  POWERSAFEFS_STAT(Clock::time_point start = Clock::now());
+  device_->unmount();
+  if (persistent_state_ != nullptr) persistent_state_->markClean();
+  trace(TRACE_DEVICE_UNMOUNT_END, 0);
+  POWERSAFEFS_STAT(stats_.recordDeviceUnmountLatency(
+      std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                            start)));
+  POWERSAFEFS_STAT(stats_.countUnmount());
+  lock.lock();
+  setReadOnly(false);
+  setMountState(FS_UNMOUNTED);
+  transition_cv_.notify_all();
+  postEvent(EVENT_UNMOUNTED);
+}
+
+void Guard::reconcile(std::unique_lock<Mutex>& lock) {
+  bool done = false;
+  while (!done) {
+    uint32_t state = state_.load(std::memory_order_acquire);
+    switch (GetMountState(state)) {
+      case FS_MOUNTING:
+      case FS_UNMOUNTING: {
+        // The thread performing the transition reconciles when done.
+        done = true;
+        break;
+      }
+      case FS_MOUNTED: {
+        if (beginUnmount()) {
+          finishUnmount(lock);
+        } else {
+          done = true;
+        }
+        break;
+      }
+      case FS_UNMOUNTED:
+      default: {
+        done = !shouldRemount(state) || !deviceMount(lock);
+        break;
       }
-      unmountIfPending();
-      break;
     }
-    case FS_SHUTDOWN: {
-      unmountIfPending();
-      break;
+  }
+  dispatchEvents(lock);
+}
+
+void Guard::postEvent(EventType type) {
+  if (listener_ == nullptr) return;
+  pending_events_.push_back(Event{type, mode()});
+}
+
+void Guard::dispatchEvents(std::unique_lock<Mutex>& lock) {
+  if (dispatching_events_) return;
+  dispatching_events_ = true;
+  while (!pending_events_.empty() && listener_ != nullptr) {
+    std::vector<Event> events;
+    auto end = pending_events_.end();
+    if (write_back_flushes_ > 0) {
+      // Leaves EVENT_WRITES_FINISHED, and the events that follow it, to be
+      // dispatched by the thread that flushes the write-back buffer.
+      end = std::find_if(pending_events_.begin(), end, [](const Event& e) {
+        return e.type == EVENT_WRITES_FINISHED;
+      });
+      if (end == pending_events_.begin()) break;
     }
-    case FS_DISABLED: {
-      if (mounted_) {
-        // Force unmount.
-        device_->unmount();
-        mounted_ = false;
+    bool writing = write_transaction_count_.load(std::memory_order_acquire) > 0;
+    for (auto i = pending_events_.begin(); i != end; ++i) {
+      // Stale if a write transaction has begun since.
+      if (i->type == EVENT_WRITES_FINISHED && writing) continue;
+      events.push_back(*i);
+    }
+    pending_events_.erase(pending_events_.begin(), end);
+    Listener* listener = listener_;
+    lock.unlock();
+    for (const Event& event : events) {
+      switch (event.type) {
+        case EVENT_MOUNTED: {
+          listener->onMounted(*this);
+          break;
+        }
+        case EVENT_UNMOUNTED: {
+          listener->onUnmounted(*this);
+          break;
+        }
+        case EVENT_MODE_CHANGED: {
+          listener->onModeChanged(*this, event.mode);
+          break;
+        }
+        case EVENT_WRITES_FINISHED: {
+          listener->onWriteTransactionsFinished(*this);
+          break;
+        }
       }
-      break;
     }
+    lock.lock();
   }
-  mode_ = mode;
+  if (listener_ == nullptr) pending_events_.clear();
+  dispatching_events_ = false;
+}
+
+void Guard::setDeferredUnmount(bool deferred) {
+  std::lock_guard<Mutex> guard(mutex_);
+  deferred_unmount_ = deferred;
+}
+
+void Guard::runDeferredUnmount() {
+  std::unique_lock<Mutex> lock(mutex_);
+  deferred_unmount_scheduled_ = false;
+  // Does nothing if the device got used again in the meantime.
+  reconcile(lock);
+}
+
+void Guard::setListener(Listener* listener) {
+  std::lock_guard<Mutex> guard(mutex_);
+  listener_ = listener;
+}
+
+void Guard::setPersistentState(PersistentState* state) {
+  std::lock_guard<Mutex> guard(mutex_);
+  persistent_state_ = state;
+  clean_hint_pending_ = (state != nullptr);
+}
+
+void Guard::setTrace(TraceBuffer* trace) {
+  std::lock_guard<Mutex> guard(mutex_);
+  trace_ = trace;
+}
+
+bool Guard::isSettled() const {
+  return !IsTransitional(state_.load(std::memory_order_acquire)) &&
+         !upgrading_ && !maintaining_;
+}
+
+void Guard::awaitSettled(std::unique_lock<Mutex>& lock) {
+  transition_cv_.wait(lock, [this]() { return isSettled(); });
+}
+
+bool Guard::awaitSettled(std::unique_lock<Mutex>& lock,
+                         Clock::time_point deadline) {
+  return transition_cv_.wait_until(lock, deadline,
+                                   [this]() { return isSettled(); });
+}
+
+bool Guard::setModeLocked(Guard::Mode mode) {
+  if (health_degraded_ && (mode == FS_NORMAL || mode == FS_EAGER_UNMOUNT)) {
+    // Switched back after degrading; judges the device afresh.
+    health_.clear();
+    health_degraded_ = false;
+  }
+  base_mode_ = mode;
+  return applyModeLocked();
+}
+
+bool Guard::applyModeLocked() {
+  Mode mode = base_mode_;
+  if (mode_overrides_ != nullptr) {
+    Mode pinned = mode_overrides_->mode_;
+    mode = (mode < FS_LAME_DUCK) ? pinned : std::max(mode, pinned);
+  }
+  uint32_t state = state_.load(std::memory_order_relaxed);
+  if (GetMode(state) == mode) return false;
+  while (!state_.compare_exchange_weak(state, WithMode(state, mode),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+  }
+  trace(TRACE_SET_MODE, mode);
+  if (mode == FS_SHUTDOWN || mode == FS_DISABLED) {
+    abort_epoch_.fetch_add(1, std::memory_order_acq_rel);
+  }
+  postEvent(EVENT_MODE_CHANGED);
+  return true;
+}
+
+void Guard::addModeOverride(ModeOverride* mode_override) {
+  std::unique_lock<Mutex> lock(mutex_);
+  mode_override->next_ = mode_overrides_;
+  if (mode_overrides_ != nullptr) mode_overrides_->prev_ = mode_override;
+  mode_overrides_ = mode_override;
+  if (!applyModeLocked()) return;
+  reconcile(lock);
+  awaitSettled(lock);
+}
+
+void Guard::removeModeOverride(ModeOverride* mode_override) {
+  std::unique_lock<Mutex> lock(mutex_);
+  if (mode_override->prev_ != nullptr) {
+    mode_override->prev_->next_ = mode_override->next_;
+  } else {
+    mode_overrides_ = mode_override->next_;
+  }
+  if (mode_override->next_ != nullptr) {
+    mode_override->next_->prev_ = mode_override->prev_;
+  }
+  if (!applyModeLocked()) return;
+  reconcile(lock);
+  awaitSettled(lock);
+}
+
+void Guard::setMode(Guard::Mode mode) {
+  std::unique_lock<Mutex> lock(mutex_);
+  if (!setModeLocked(mode)) return;
+  reconcile(lock);
+  // If another thread is in the middle of a device transition, it will
+  // reconcile with the new mode once done.
+  awaitSettled(lock);
+}
+
+bool Guard::updateMode(Guard::Mode mode) {
+  std::lock_guard<Mutex> guard(mutex_);
+  return setModeLocked(mode);
+}
+
+void Guard::settle() {
+  std::unique_lock<Mutex> lock(mutex_);
+  reconcile(lock);
+  awaitSettled(lock);
+}
+
+void Guard::setUnmountDelay(std::chrono::microseconds delay) {
+  setAdaptiveUnmountDelay(delay, delay);
+}
+
+void Guard::setAdaptiveUnmountDelay(std::chrono::microseconds min_delay,
+                                    std::chrono::microseconds max_delay) {
+  std::unique_lock<Mutex> lock(mutex_);
+  min_unmount_delay_ = min_delay;
+  max_unmount_delay_ = std::max(min_delay, max_delay);
+  if (idle_since_ != Clock::time_point::min()) {
+    unmount_not_before_ = idle_since_ + unmountDelay();
+  }
+  reconcile(lock);
+}
+
+std::chrono::microseconds Guard::unmountDelay() const {
+  if (avg_idle_time_ > max_unmount_delay_) return min_unmount_delay_;
+  return std::max(min_unmount_delay_,
+                  std::min(max_unmount_delay_, 2 * avg_idle_time_));
+}
+
+void Guard::onIdleStart(Clock::time_point now) {
+  idle_since_ = now;
+  // Keeps the grace period of a prefetch, if longer.
+  unmount_not_before_ = std::max(unmount_not_before_, now + unmountDelay());
+}
+
+void Guard::onIdleEnd(Clock::time_point now) {
+  if (idle_since_ == Clock::time_point::min()) return;
+  auto idle_time =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - idle_since_);
+  avg_idle_time_ = (3 * avg_idle_time_ + idle_time) / 4;
+  idle_since_ = Clock::time_point::min();
+}
+
+void Guard::enableWriteBack(size_t capacity, size_t alignment,
+                            std::chrono::microseconds max_age) {
+  write_back_.reset(new WriteBackBuffer(capacity, alignment, max_age));
+}
+
+bool Guard::flushWriteBack(WriteTarget* target) {
+  if (write_back_ == nullptr) return true;
+  return target == nullptr ? write_back_->flush() : write_back_->flush(target);
+}
+
+void Guard::tick() {
+  if (write_back_ != nullptr) write_back_->flushIfExpired();
+  std::unique_lock<Mutex> lock(mutex_);
+  reconcile(lock);
+  maybeMaintain(lock);
+}
+
+void Guard::setMaintenance(std::chrono::microseconds idle_threshold,
+                           std::chrono::microseconds budget) {
+  std::lock_guard<Mutex> guard(mutex_);
+  maintenance_idle_threshold_ = idle_threshold;
+  maintenance_budget_ = budget;
+  // Activity has not been tracked while disabled.
+  last_activity_ = Clock::now();
+  maintenance_done_ = false;
+}
+
+void Guard::noteActivity() {
+  if (maintenance_budget_.count() <= 0) return;
+  last_activity_ = Clock::now();
+  maintenance_done_ = false;
+}
+
+void Guard::maybeMaintain(std::unique_lock<Mutex>& lock) {
+  if (maintenance_budget_.count() <= 0 || maintaining_ || upgrading_) return;
+  uint32_t state = state_.fetch_and(~kActivityBit, std::memory_order_acq_rel);
+  if ((state & kActivityBit) != 0 || GetMountCount(state) > 0 ||
+      write_transaction_count_.load(std::memory_order_acquire) > 0) {
+    // Used since the last tick, possibly via the lock-free paths, which
+    // don't note activity themselves.
+    noteActivity();
+    return;
+  }
+  if (GetMode(state) != FS_NORMAL || GetMountState(state) != FS_MOUNTED ||
+      (state & kReadOnlyBit) != 0) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  if (maintenance_done_ || now - last_activity_ < maintenance_idle_threshold_) {
+    return;
+  }
+  maintaining_ = true;
+  MaintenanceBudget budget(this, now + maintenance_budget_);
+  lock.unlock();
+  bool done = device_->maintain(budget);
+  lock.lock();
+  maintaining_ = false;
+  // If preempted by a new request, the request has noted activity (or will
+  // be seen by the next tick), which starts a new idle period.
+  if (done) maintenance_done_ = true;
+  transition_cv_.notify_all();
+  // The mode might have changed while we were maintaining.
+  reconcile(lock);
+}
+
+bool Guard::drain(Clock::time_point deadline) {
+  std::unique_lock<Mutex> lock(mutex_);
+  if (base_mode_ != FS_DISABLED) {
+    setModeLocked(FS_SHUTDOWN);
+    reconcile(lock);
+    if (!writes_cv_.wait_until(lock, deadline, [this]() {
+          return write_transaction_count_.load(std::memory_order_acquire) ==
+                 0;
+        })) {
+      return false;
+    }
+    setModeLocked(FS_DISABLED);
+    reconcile(lock);
+  }
+  return awaitSettled(lock, deadline) && mountState() == FS_UNMOUNTED;
+}
+
+void Guard::abortWriteTransactions() {
+  abort_epoch_.fetch_add(1, std::memory_order_acq_rel);
 }
 
 bool Guard::isMounted() const {
-  std::lock_guard<std::mutex> guard(mutex_);
-  return mounted_;
+  return IsMounted(state_.load(std::memory_order_acquire));
 }
 
 Mount Guard::mount(bool forced) {
@@ -105,74 +846,475 @@ WriteTransaction Guard::write(bool forced) {
   return WriteTransaction(this, forced);
 }
 
+WriteTransaction Guard::write(WritePriority priority, bool forced) {
+  return WriteTransaction(this, priority, forced);
+}
+
+WriteBatch Guard::writeBatch(WritePriority priority, bool forced) {
+  return WriteBatch(this, priority, forced);
+}
+
+WriteMount Guard::mountForWrite(bool forced) {
+  return mountForWrite(WRITE_PRIORITY_NORMAL, forced);
+}
+
+WriteMount Guard::mountForWrite(WritePriority priority, bool forced) {
+  // Read before admission; see WriteTransaction.
+  uint32_t epoch = abort_epoch_.load(std::memory_order_acquire);
+  std::unique_lock<Mutex> lock(mutex_);
+  if (!tryMountLocked(lock, forced, mount_failures_)) return WriteMount();
+  bool active = tryBeginWriteTransactionLocked(lock, priority, forced);
+  trace(active ? TRACE_WRITE_BEGIN : TRACE_WRITE_REJECTED, priority);
+  if (!active) {
+    trace(TRACE_UNMOUNT, forced);
+    unmountLocked(lock, forced);
+    return WriteMount();
+  }
+  lock.unlock();
+  return WriteMount(Mount(this, forced, true),
+                    WriteTransaction(this, priority, forced, epoch, true));
+}
+
+void Guard::mountAsync(MountCallback callback, bool forced) {
+  if (!forced && tryMountFast()) {
+    callback(Mount(this, forced, true));
+    return;
+  }
+  std::unique_lock<Mutex> lock(mutex_);
+  uint32_t state = state_.load(std::memory_order_acquire);
+  if (!Admits(GetMode(state), forced) || IsMounted(state)) {
+    // Resolves without blocking.
+    bool mounted = tryMountLocked(lock, forced, mount_failures_);
+    lock.unlock();
+    callback(Mount(this, forced, mounted));
+    return;
+  }
+  pending_async_mounts_.push_back(
+      AsyncMountRequest{std::move(callback), forced});
+  if (async_mount_scheduled_) return;
+  async_mount_scheduled_ = true;
+  Executor executor = executor_;
+  lock.unlock();
+  executor([this]() { runAsyncMounts(); });
+}
+
+Mount Guard::mount(std::chrono::microseconds timeout, bool forced) {
+  if (!forced && tryMountFast()) return Mount(this, forced, true);
+  std::unique_lock<Mutex> lock(mutex_);
+  bool mounted =
+      tryMountLocked(lock, forced, mount_failures_, Clock::now() + timeout);
+  return Mount(this, forced, mounted);
+}
+
+void Guard::prefetchMount(std::chrono::microseconds grace_period) {
+  {
+    std::lock_guard<Mutex> guard(mutex_);
+    if (!Admits(mode(), false)) return;
+    unmount_not_before_ =
+        std::max(unmount_not_before_, Clock::now() + grace_period);
+  }
+  // The mount is released right away; the grace period keeps the device
+  // mounted.
+  mountAsync([](Mount) {});
+}
+
+void Guard::setMountRetryBackoff(std::chrono::microseconds initial_delay,
+                                 std::chrono::microseconds max_delay) {
+  std::lock_guard<Mutex> guard(mutex_);
+  // A zero delay would never grow, retrying back to back.
+  initial_retry_delay_ =
+      std::max(initial_delay, std::chrono::microseconds(1));
+  max_retry_delay_ = std::max(initial_retry_delay_, max_delay);
+}
+
+void Guard::setExecutor(Executor executor) {
+  std::lock_guard<Mutex> guard(mutex_);
+  executor_ = std::move(executor);
+}
+
+void Guard::runAsyncMounts() {
+  std::unique_lock<Mutex> lock(mutex_);
+  while (!pending_async_mounts_.empty()) {
+    std::vector<AsyncMountRequest> requests;
+    requests.swap(pending_async_mounts_);
+    std::vector<bool> results;
+    results.reserve(requests.size());
+    // If the mount attempt fails, the requests in the batch fail together.
+    uint32_t mount_failures = mount_failures_;
+    for (const AsyncMountRequest& request : requests) {
+      results.push_back(tryMountLocked(lock, request.forced, mount_failures));
+    }
+    lock.unlock();
+    for (size_t i = 0; i < requests.size(); ++i) {
+      requests[i].callback(Mount(this, requests[i].forced, results[i]));
+    }
+    lock.lock();
+  }
+  async_mount_scheduled_ = false;
+}
+
 int Guard::getPendingMountsCount() const {
-  std::lock_guard<std::mutex> guard(mutex_);
-  return mount_count_;
+  return GetMountCount(state_.load(std::memory_order_acquire));
 }
 
 int Guard::getPendingWriteTransactionsCount() const {
-  std::lock_guard<std::mutex> guard(mutex_);
-  return write_transaction_count_;
+  return write_transaction_count_.load(std::memory_order_acquire);
+}
+
+int Guard::getPendingWriteTransactionsCount(WritePriority priority) const {
+  std::lock_guard<Mutex> guard(mutex_);
+  return write_transaction_count_by_priority_[priority];
+}
+
+void Guard::setMinWritePriority(WritePriority priority) {
+  std::lock_guard<Mutex> guard(mutex_);
+  min_write_priority_ = priority;
+}
+
+void Guard::setWriteQuota(WritePriority priority, int max_concurrent) {
+  std::lock_guard<Mutex> guard(mutex_);
+  write_quota_[priority] = max_concurrent;
+}
+
+void Guard::setSupplyThresholds(
+    const int (&thresholds)[kWritePriorityCount]) {
+  std::lock_guard<Mutex> guard(mutex_);
+  for (int i = 0; i < kWritePriorityCount; ++i) {
+    supply_thresholds_[i] = thresholds[i];
+  }
+}
+
+void Guard::reportSupplyLevel(int level) {
+  std::lock_guard<Mutex> guard(mutex_);
+  int min_priority = 0;
+  while (min_priority < kWritePriorityCount &&
+         level < supply_thresholds_[min_priority]) {
+    ++min_priority;
+  }
+  min_write_priority_ = min_priority;
+}
+
+void Guard::setWriteBudget(uint64_t bytes_per_hour, uint64_t burst_bytes) {
+  std::lock_guard<Mutex> guard(mutex_);
+  write_budget_rate_ = bytes_per_hour;
+  write_budget_burst_ = burst_bytes;
+  write_budget_tokens_ = (int64_t)burst_bytes;
+  write_budget_updated_ = Clock::now();
+  write_budget_spent_.store(0, std::memory_order_relaxed);
+}
+
+int64_t Guard::getWriteBudget() {
+  std::lock_guard<Mutex> guard(mutex_);
+  if (write_budget_rate_ == 0) return -1;
+  updateWriteBudget(Clock::now());
+  return write_budget_tokens_;
+}
+
+void Guard::setHealthThresholds(const HealthThresholds& thresholds) {
+  std::lock_guard<Mutex> guard(mutex_);
+  health_thresholds_ = thresholds;
+  health_tracking_ = true;
+}
+
+int Guard::healthScore() const {
+  std::lock_guard<Mutex> guard(mutex_);
+  return health_.score(health_thresholds_);
+}
+
+Stats Guard::stats() const {
+#if ROO_POWERSAFEFS_STATS
+  return stats_.snapshot();
+#else
+  return Stats();
+#endif
+}
+
+bool Guard::tryMountFast() {
+  // Acquiring the first Mount is left to the slow path, which keeps track
+  // of idle periods.
+  uint32_t state = state_.load(std::memory_order_acquire);
+  while (IsMounted(state) && Admits(GetMode(state), false) &&
+         (GetMountCount(state) > 0 || GetMode(state) == FS_NORMAL)) {
+    if (state_.compare_exchange_weak(state,
+                                     (state + kMountCountOne) | kActivityBit,
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      POWERSAFEFS_STAT(stats_.countWarmMount());
+      trace(TRACE_MOUNT, 0);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Guard::tryUnmountFast() {
+  // The last Mount in modes other than FS_NORMAL may need to unmount the
+  // device, which is left to the slow path.
+  uint32_t state = state_.load(std::memory_order_acquire);
+  while (IsMounted(state) &&
+         (GetMountCount(state) > 1 || GetMode(state) == FS_NORMAL)) {
+    if (state_.compare_exchange_weak(state, state - kMountCountOne,
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 bool Guard::tryMount(bool forced) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  switch (mode_) {
-    case FS_DISABLED:
-    case FS_SHUTDOWN: {
+  if (!forced && tryMountFast()) return true;
+  std::unique_lock<Mutex> lock(mutex_);
+  return tryMountLocked(lock, forced, mount_failures_);
+}
+
+bool Guard::tryMountLocked(std::unique_lock<Mutex>& lock, bool forced,
+                           uint32_t mount_failures,
+                           Clock::time_point retry_deadline) {
+  bool mounted = acquireMountLocked(lock, forced, mount_failures,
+                                    retry_deadline);
+  // Delivers the events either way; e.g. a failed mount may have degraded
+  // the mode (see recordDeviceCall()).
+  dispatchEvents(lock);
+  return mounted;
+}
+
+bool Guard::acquireMountLocked(std::unique_lock<Mutex>& lock, bool forced,
+                               uint32_t mount_failures,
+                               Clock::time_point retry_deadline) {
+  bool retry = (retry_deadline != Clock::time_point::min());
+  bool attempted = false;
+  POWERSAFEFS_STAT(bool cold = false);
+  while (true) {
+    uint32_t state = state_.load(std::memory_order_acquire);
+    if (!Admits(GetMode(state), forced)) {
+      POWERSAFEFS_STAT(stats_.countRejectedMount(GetMode(state)));
+      trace(TRACE_MOUNT_REJECTED, forced);
+      // The mode might have changed while we were mounting the device.
+      reconcile(lock);
       return false;
     }
-    case FS_LAME_DUCK: {
-      if (!forced) return false;
-    }
-    case FS_NORMAL:
-    case FS_EAGER_UNMOUNT: {
+    switch (GetMountState(state)) {
+      case FS_MOUNTED: {
+        state = state_.fetch_add(kMountCountOne, std::memory_order_acq_rel);
+        if (forced) ++forced_mount_count_;
+        if (GetMountCount(state) == 0) onIdleEnd(Clock::now());
+        noteActivity();
+        POWERSAFEFS_STAT(cold ? stats_.countColdMount()
+                              : stats_.countWarmMount());
+        POWERSAFEFS_STAT(if (forced) stats_.countForcedMount());
+        trace(TRACE_MOUNT, forced);
+        return true;
+      }
+      case FS_MOUNTING:
+      case FS_UNMOUNTING: {
+        if (!retry) {
+          awaitSettled(lock);
+        } else if (!awaitSettled(lock, retry_deadline)) {
+          return false;
+        }
+        break;
+      }
+      case FS_UNMOUNTED:
+      default: {
+        if (!retry) {
+          // Don't retry if the mount attempt that we have been waiting for
+          // has failed.
+          if (mount_failures != mount_failures_) return false;
+        } else {
+          Clock::time_point now = Clock::now();
+          // Checked before every retry, so that a short backoff can't spin
+          // past the deadline.
+          if (attempted && now >= retry_deadline) return false;
+          if (now < next_mount_retry_) {
+            // Wait for the scheduled retry (or for some other request to
+            // mount the device in the meantime).
+            if (now >= retry_deadline) return false;
+            transition_cv_.wait_until(
+                lock, std::min(next_mount_retry_, retry_deadline));
+            break;
+          }
+        }
+        attempted = true;
+        if (deviceMount(lock)) {
+          POWERSAFEFS_STAT(cold = true);
+        } else if (!retry) {
+          return false;
+        }
+        break;
+      }
     }
   }
-  if (!mounted_) {
-    mounted_ = device_->mount();
-  }
-  if (mounted_) {
-    ++mount_count_;
-    if (forced) ++forced_mount_count_;
-  }
-  return mounted_;
 }
 
 void Guard::unmount(bool forced) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  --mount_count_;
+  trace(TRACE_UNMOUNT, forced);
+  if (!forced && tryUnmountFast()) return;
+  std::unique_lock<Mutex> lock(mutex_);
+  unmountLocked(lock, forced);
+}
+
+void Guard::unmountLocked(std::unique_lock<Mutex>& lock, bool forced) {
+  uint32_t state =
+      state_.fetch_sub(kMountCountOne, std::memory_order_acq_rel) -
+      kMountCountOne;
   if (forced) --forced_mount_count_;
-  if (mounted_ && mount_count_ == 0 && mode_ != FS_NORMAL) {
-    device_->unmount();
-    mounted_ = false;
+  if (GetMountCount(state) == 0) onIdleStart(Clock::now());
+  noteActivity();
+  if (!deferred_unmount_) {
+    reconcile(lock);
+    return;
+  }
+  // Releasing a mount never requires mounting the device, so the only
+  // possible device transition is an unmount.
+  if (deferred_unmount_scheduled_ || !IsMounted(state) ||
+      !shouldUnmount(state)) {
+    return;
   }
+  deferred_unmount_scheduled_ = true;
+  Executor executor = executor_;
+  lock.unlock();
+  executor([this]() { runDeferredUnmount(); });
 }
 
-bool Guard::tryBeginWriteTransaction(bool forced) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  if (!mounted_) return false;
-  switch (mode_) {
-    case FS_DISABLED:
-    case FS_SHUTDOWN: {
+bool Guard::admitsWritePriority(Mode mode, WritePriority priority,
+                                bool forced) const {
+  // In FS_LAME_DUCK, only forced writers are admitted, so they are the ones
+  // to shed.
+  if (forced && mode != FS_LAME_DUCK) return true;
+  if (priority < min_write_priority_) return false;
+  return write_quota_[priority] < 0 ||
+         write_transaction_count_by_priority_[priority] <
+             write_quota_[priority];
+}
+
+void Guard::updateWriteBudget(Clock::time_point now) {
+  static constexpr uint64_t kMicrosPerHour = 3600000000ULL;
+  write_budget_tokens_ -=
+      (int64_t)write_budget_spent_.exchange(0, std::memory_order_relaxed);
+  int64_t missing = (int64_t)write_budget_burst_ - write_budget_tokens_;
+  if (missing <= 0) {
+    write_budget_updated_ = now;
+    return;
+  }
+  int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                        now - write_budget_updated_)
+                        .count();
+  if (elapsed <= 0) return;
+  if ((uint64_t)elapsed >=
+      ((uint64_t)missing * kMicrosPerHour + write_budget_rate_ - 1) /
+          write_budget_rate_) {
+    // Enough time to refill completely.
+    write_budget_tokens_ = (int64_t)write_budget_burst_;
+    write_budget_updated_ = now;
+    return;
+  }
+  uint64_t added = (uint64_t)elapsed * write_budget_rate_ / kMicrosPerHour;
+  write_budget_tokens_ += (int64_t)added;
+  // Carries over the time that has not yet earned a whole byte.
+  write_budget_updated_ += std::chrono::microseconds(
+      added * kMicrosPerHour / write_budget_rate_);
+}
+
+bool Guard::tryBeginWriteTransaction(WritePriority priority, bool forced) {
+  std::unique_lock<Mutex> lock(mutex_);
+  return tryBeginWriteTransactionLocked(lock, priority, forced);
+}
+
+bool Guard::tryBeginWriteTransactionLocked(std::unique_lock<Mutex>& lock,
+                                           WritePriority priority,
+                                           bool forced) {
+  while (true) {
+    uint32_t state = state_.load(std::memory_order_acquire);
+    if (!IsMounted(state) || !Admits(GetMode(state), forced)) {
+      POWERSAFEFS_STAT(stats_.countRejectedWriteTransaction(GetMode(state)));
       return false;
     }
-    case FS_LAME_DUCK: {
-      if (!forced) return false;
+    if (!admitsWritePriority(GetMode(state), priority, forced)) {
+      POWERSAFEFS_STAT(stats_.countShedWriteTransaction());
+      return false;
     }
-    case FS_NORMAL:
-    case FS_EAGER_UNMOUNT: {
+    if (write_budget_rate_ != 0 && !forced) {
+      updateWriteBudget(Clock::now());
+      if (write_budget_tokens_ <= 0) {
+        POWERSAFEFS_STAT(stats_.countOverBudgetWriteTransaction());
+        return false;
+      }
+    }
+    if ((state & kReadOnlyBit) == 0) break;
+    if (upgrading_) {
+      transition_cv_.wait(lock);
+      continue;
+    }
+    // The first writer upgrades the read-only mount. Readers are not
+    // affected.
+    upgrading_ = true;
+    lock.unlock();
+    Clock::time_point start = Clock::now();
+    bool upgraded = device_->remountReadWrite();
+    lock.lock();
+    recordDeviceCall(start, upgraded);
+    upgrading_ = false;
+    if (upgraded) setReadOnly(false);
+    transition_cv_.notify_all();
+    // The mode might have changed while we were upgrading.
+    reconcile(lock);
+    if (!upgraded) {
+      POWERSAFEFS_STAT(stats_.countRejectedWriteTransaction(GetMode(state)));
+      return false;
     }
   }
-  ++write_transaction_count_;
+  write_transaction_count_.fetch_add(1, std::memory_order_acq_rel);
+  ++write_transaction_count_by_priority_[priority];
   if (forced) ++forced_write_transaction_count_;
+  noteActivity();
+  POWERSAFEFS_STAT(stats_.countWriteTransaction());
+  POWERSAFEFS_STAT(if (forced) stats_.countForcedWriteTransaction());
   return true;
 }
 
-void Guard::endWriteTransaction(bool forced) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  --write_transaction_count_;
+void Guard::endWriteTransaction(WritePriority priority, bool forced) {
+  trace(TRACE_WRITE_END, priority);
+  std::unique_lock<Mutex> lock(mutex_);
+  if (releaseWriteTransactionLocked(priority, forced) != 0) return;
+  finishWriteTransactionsLocked(lock);
+  dispatchEvents(lock);
+}
+
+void Guard::finishWriteTransactionsLocked(std::unique_lock<Mutex>& lock) {
+  postEvent(EVENT_WRITES_FINISHED);
+  if (write_back_ != nullptr) {
+    // The flush does not hold the mutex, so that new transactions are not
+    // blocked by it.
+    ++write_back_flushes_;
+    lock.unlock();
+    write_back_->flushRetainingErrors();
+    lock.lock();
+    --write_back_flushes_;
+  }
+  writes_cv_.notify_all();
+}
+
+int Guard::releaseWriteTransactionLocked(WritePriority priority,
+                                         bool forced) {
+  int remaining =
+      write_transaction_count_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+  --write_transaction_count_by_priority_[priority];
   if (forced) --forced_write_transaction_count_;
+  noteActivity();
+  return remaining;
+}
+
+void Guard::endWriteTransactionAndUnmount(WritePriority priority,
+                                          bool forced) {
+  trace(TRACE_WRITE_END, priority);
+  trace(TRACE_UNMOUNT, forced);
+  std::unique_lock<Mutex> lock(mutex_);
+  if (releaseWriteTransactionLocked(priority, forced) == 0) {
+    finishWriteTransactionsLocked(lock);
+    dispatchEvents(lock);
+  }
+  unmountLocked(lock, forced);
 }
 
 }  // namespace roo_powersafefs
\ No newline at end of file
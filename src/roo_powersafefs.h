@@ -1,18 +1,93 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <utility>
+#include <vector>
+
+#include "roo_powersafefs/health.h"
+#include "roo_powersafefs/persistent_state.h"
+#include "roo_powersafefs/stats.h"
+#include "roo_powersafefs/sync.h"
+#include "roo_powersafefs/trace.h"
+#include "roo_powersafefs/write_back.h"
 
 namespace roo_powersafefs {
 
+using Clock = std::chrono::steady_clock;
+
+class Guard;
+class ModeOverride;
+class WriteMount;
+
+// Passed to Device::maintain(), to tell it when to stop.
+class MaintenanceBudget {
+ public:
+  // Returns true if maintenance should stop as soon as possible, because
+  // the filesystem is needed (a Mount or a WriteTransaction has arrived),
+  // the mode has changed, or the deadline has passed. Lock-free.
+  bool shouldYield() const;
+
+  Clock::time_point deadline() const { return deadline_; }
+
+ private:
+  friend class Guard;
+
+  MaintenanceBudget(const Guard* guard, Clock::time_point deadline)
+      : guard_(guard), deadline_(deadline) {}
+
+  const Guard* guard_;
+  Clock::time_point deadline_;
+};
+
 class Device {
  public:
   virtual ~Device() {}
   virtual bool mount() = 0;
   virtual void unmount() = 0;
+
+  // Optional support for read-only mounts, which many filesystems can do
+  // much faster (e.g. skipping journal replay or free space scans). If
+  // supported, the guard mounts the device read-only while there are no
+  // write transactions, and upgrades the mount in place, by calling
+  // remountReadWrite(), when the first write transaction begins.
+  virtual bool supportsReadOnlyMount() const { return false; }
+  virtual bool mountReadOnly() { return mount(); }
+  virtual bool remountReadWrite() { return true; }
+
+  // Optional background maintenance (e.g. garbage collection, compaction,
+  // or caching free space), run while the filesystem is mounted read-write
+  // but idle; see Guard::setMaintenance(). Should work in small steps,
+  // and return as soon as budget.shouldYield(). Requests that arrive in
+  // the meantime are granted without waiting, so the work must be safe to
+  // interrupt, and to run concurrently with filesystem accesses until it
+  // returns. Returns true if there is nothing more to do; otherwise, the
+  // guard calls it again in the same idle period.
+  virtual bool maintain(const MaintenanceBudget& budget) { return true; }
+
+  // Called once, before the first mount after a reset, if the guard keeps
+  // a PersistentState (see Guard::setPersistentState()). If clean is true,
+  // the device has been cleanly unmounted before the reset, so the next
+  // mount may skip recovery work, such as a journal replay or fsck.
+  virtual void setLastUnmountClean(bool clean) {}
 };
 
-class Guard;
+// Priority of a write transaction. When power is scarce, the guard can be
+// configured to shed low-priority writers (e.g. telemetry), while the
+// high-priority ones (e.g. checkpointing) are still admitted. See
+// Guard::setMinWritePriority().
+enum WritePriority {
+  WRITE_PRIORITY_LOW,
+  WRITE_PRIORITY_NORMAL,
+  WRITE_PRIORITY_HIGH,
+  WRITE_PRIORITY_CRITICAL
+};
+
+static constexpr int kWritePriorityCount = WRITE_PRIORITY_CRITICAL + 1;
 
 // Created in order to request that the filesystem is mounted. The filesystem
 // will remain mounted for as long as this object is alive. If the guard
@@ -28,15 +103,30 @@ class Guard;
 // }
 class Mount {
  public:
+  // Creates an empty Mount, which does not hold the filesystem mounted. Can
+  // be move-assigned to later.
+  Mount();
+
   Mount(Guard* guard, bool forced = false);
   Mount(Mount&& other);
 
+  // Releases the currently held mount, if any, and takes over the other's.
+  Mount& operator=(Mount&& other);
+
   bool mounted() const { return mounted_; }
+  explicit operator bool() const { return mounted_; }
+
+  // Releases the mount, if held, leaving this object empty.
+  void reset();
 
   ~Mount();
 
  private:
   friend class Guard;
+  friend class WriteMount;
+
+  // Takes over a mount reference already acquired by the guard.
+  Mount(Guard* guard, bool forced, bool mounted);
 
   Mount(const Mount&) = delete;
   Mount& operator=(const Mount&) = delete;
@@ -46,6 +136,49 @@ class Mount {
   bool mounted_;
 };
 
+// Copyable mount handle, for sharing a single mount between several tasks
+// (e.g. workers processing chunks of one file). Created from a Mount, which
+// it takes over. Copies share the same underlying mount, reference-counted
+// locally to the handle, so that the guard is only involved when the
+// handle is created and when the last copy is released. Typical usage
+// scenario:
+//
+// SharedMount mount{Mount(&guard)};
+// if (mount.mounted()) {
+//   for (...) StartWorker([mount]() { ... });
+// }
+class SharedMount {
+ public:
+  // Creates an empty SharedMount, which does not hold the filesystem
+  // mounted.
+  SharedMount() : shared_(nullptr) {}
+
+  // Takes over the mount. If it is not mounted, the result is empty.
+  explicit SharedMount(Mount&& mount);
+
+  SharedMount(const SharedMount& other);
+  SharedMount(SharedMount&& other) : shared_(other.shared_) {
+    other.shared_ = nullptr;
+  }
+
+  SharedMount& operator=(const SharedMount& other);
+  SharedMount& operator=(SharedMount&& other);
+
+  ~SharedMount() { reset(); }
+
+  bool mounted() const { return shared_ != nullptr; }
+  explicit operator bool() const { return mounted(); }
+
+  // Drops this reference, leaving this object empty. Releases the mount if
+  // it was the last one.
+  void reset();
+
+ private:
+  struct Shared;
+
+  Shared* shared_;
+};
+
 // Created in order to signal intent to perform a write operation on the
 // file system. The typical usage scenario:
 //
@@ -54,22 +187,162 @@ class Mount {
 //   WriteTransaction write(&guard);
 //   if (write.active()) { ... }
 // }
+//
+// See also Guard::mountForWrite(), which acquires both at once.
 class WriteTransaction {
  public:
+  // Creates an inactive WriteTransaction. Can be move-assigned to later.
+  WriteTransaction();
+
   WriteTransaction(Guard* guard, bool forced = false);
+  WriteTransaction(Guard* guard, WritePriority priority, bool forced = false);
   WriteTransaction(WriteTransaction&& other);
 
+  // Ends the current transaction, if active, and takes over the other's.
+  WriteTransaction& operator=(WriteTransaction&& other);
+
   ~WriteTransaction();
 
   bool active() const { return active_; }
+  explicit operator bool() const { return active_; }
+
+  // Ends the transaction, if active, leaving this object inactive.
+  void reset();
+
+  // Returns true if the guard has requested outstanding write transactions
+  // to stop, e.g. because of setMode(FS_SHUTDOWN). Long-running writers
+  // (e.g. a firmware image write) should check it periodically, and end
+  // the transaction at the next safe point. Once set, stays set for the
+  // lifetime of this transaction. Lock-free.
+  bool shouldAbort() const;
+
+  // Writes the data to the target, through the guard's write-back buffer if
+  // enabled (see Guard::enableWriteBack()). Must only be called while
+  // active(). Returns false if a write has failed, including an earlier
+  // automatic flush of data buffered for the target, not reported yet. The
+  // size is charged to the guard's write budget (see Guard::setWriteBudget()).
+  bool write(WriteTarget* target, const void* data, size_t size);
+
+  // Charges the specified number of bytes to the guard's write budget. Use
+  // it when writing other than via write(). May be called up front, to
+  // declare the expected size of the transaction. Lock-free.
+  void reportBytesWritten(size_t bytes);
 
  private:
+  friend class Guard;
+  friend class WriteBatch;
+  friend class WriteMount;
+
+  // Takes over a write transaction already admitted by the guard.
+  WriteTransaction(Guard* guard, WritePriority priority, bool forced,
+                   uint32_t epoch, bool active);
+
   WriteTransaction(const WriteTransaction&) = delete;
   WriteTransaction& operator=(const WriteTransaction&) = delete;
 
   Guard* guard_;
+  WritePriority priority_;
   bool forced_;
+
+  // The guard's abort epoch as of the start of the transaction.
+  uint32_t epoch_;
+
   bool active_;
+
+#if ROO_POWERSAFEFS_STATS
+  Clock::time_point start_;
+#endif
+};
+
+// Write transaction for a producer that performs many small writes, e.g.
+// one per log record. Reserves a write slot once, and lets the producer
+// check cheaply (a single atomic load, without locking) whether the guard
+// has been asked to wind down, i.e. switched to a mode that would no
+// longer admit this batch, in which case the producer should commit early.
+// Typical usage scenario:
+//
+// Mount mount(&guard);
+// WriteBatch batch(&guard);
+// while (batch.active() && !batch.windDownRequested() && HasRecords()) {
+//   batch.write(&file, record, size);
+// }
+// batch.commit();
+class WriteBatch {
+ public:
+  WriteBatch() = default;
+  WriteBatch(Guard* guard, WritePriority priority = WRITE_PRIORITY_NORMAL,
+             bool forced = false);
+  WriteBatch(WriteBatch&& other) = default;
+  WriteBatch& operator=(WriteBatch&& other) = default;
+
+  bool active() const { return transaction_.active(); }
+  explicit operator bool() const { return active(); }
+
+  // Returns true if the guard's mode no longer admits new write
+  // transactions like this one (e.g. after setMode(FS_LAME_DUCK) for a
+  // non-forced batch, or after setMode(FS_SHUTDOWN)).
+  bool windDownRequested() const;
+
+  // See WriteTransaction::write().
+  bool write(WriteTarget* target, const void* data, size_t size) {
+    return transaction_.write(target, data, size);
+  }
+
+  // See WriteTransaction::shouldAbort().
+  bool shouldAbort() const { return transaction_.shouldAbort(); }
+
+  // Ends the batch, releasing the write slot.
+  void commit() { transaction_.reset(); }
+
+ private:
+  WriteTransaction transaction_;
+};
+
+// A mount and a write transaction, acquired together in a single critical
+// section of the guard (so that the mode cannot change in between), and
+// released together. See Guard::mountForWrite(). Typical usage scenario:
+//
+// WriteMount write = guard.mountForWrite();
+// if (write.active()) {
+//   write.write(&file, data, size);
+// }
+class WriteMount {
+ public:
+  // Creates an inactive WriteMount. Can be move-assigned to later.
+  WriteMount() = default;
+
+  WriteMount(WriteMount&& other) = default;
+
+  // Releases the currently held mount and transaction, if any, and takes
+  // over the other's.
+  WriteMount& operator=(WriteMount&& other);
+
+  ~WriteMount() { reset(); }
+
+  bool active() const { return transaction_.active(); }
+  explicit operator bool() const { return active(); }
+
+  // Ends the transaction and releases the mount, if held, leaving this
+  // object inactive.
+  void reset();
+
+  // The write transaction, e.g. for shouldAbort() or reportBytesWritten().
+  WriteTransaction& transaction() { return transaction_; }
+
+  // See WriteTransaction::write().
+  bool write(WriteTarget* target, const void* data, size_t size) {
+    return transaction_.write(target, data, size);
+  }
+
+ private:
+  friend class Guard;
+
+  WriteMount(Mount mount, WriteTransaction transaction)
+      : mount_(std::move(mount)), transaction_(std::move(transaction)) {}
+
+  // Declared in the order of acquisition.
+  Mount mount_;
+  WriteTransaction transaction_;
 };
 
 class Guard {
@@ -81,7 +354,8 @@ class Guard {
     FS_NORMAL,
 
     // Like FS_NORMAL, except that the filesystem gets
-    // unmounted as soon as all mount objects are destroyed.
+    // unmounted as soon as all mount objects are destroyed, or, if an
+    // unmount delay is configured, once it has been idle for that long.
     FS_EAGER_UNMOUNT,
 
     // New mount and write transaction requests are rejected,
@@ -98,46 +372,602 @@ class Guard {
     FS_DISABLED
   };
 
+  // State of the underlying device. Device::mount() and Device::unmount()
+  // are called without holding the guard's lock; while they are in
+  // progress, the device is in one of the transitional states. Mount
+  // requests arriving at that time wait for the transition to complete.
+  enum MountState { FS_UNMOUNTED, FS_MOUNTING, FS_MOUNTED, FS_UNMOUNTING };
+
+  // Receives notifications about state changes of a guard, e.g. to power
+  // down the SD card rail as soon as the device gets unmounted, without
+  // polling. Notifications are delivered in order, outside of the guard's
+  // lock, from the thread that happens to have caused (or to be delivering)
+  // them; they should return quickly. They may call into the guard.
+  class Listener {
+   public:
+    virtual ~Listener() {}
+
+    // The device has been mounted.
+    virtual void onMounted(Guard& guard) {}
+
+    // The device has been unmounted.
+    virtual void onUnmounted(Guard& guard) {}
+
+    // The mode has been changed.
+    virtual void onModeChanged(Guard& guard, Mode mode) {}
+
+    // The last outstanding write transaction has ended, and the write-back
+    // buffer (if any) has been flushed. Skipped if another write
+    // transaction has begun before the event got dispatched (but one may
+    // begin while this is running).
+    virtual void onWriteTransactionsFinished(Guard& guard) {}
+  };
+
+  // Runs the specified task asynchronously (e.g. in a worker thread, or by
+  // posting it to an event loop).
+  using Executor = std::function<void(std::function<void()>)>;
+
+  // Called with the result of mountAsync(). Check Mount::mounted() to find
+  // out if the request has been granted.
+  using MountCallback = std::function<void(Mount)>;
+
   Guard(Device* device);
 
+  // Returns the effective mode, i.e. the mode set by setMode(), possibly
+  // overridden by a ModeOverride.
   Mode mode() const;
+
+  // Returns the mode set by setMode(), ignoring overrides.
+  Mode baseMode() const;
+
+  // Changes the mode, and mounts or unmounts the device as needed. Returns
+  // after the device has settled in a non-transitional state.
   void setMode(Mode);
 
+  // Bounded-time shutdown, e.g. on power loss. Switches to FS_SHUTDOWN, so
+  // that new requests are rejected; waits (without spinning) until all
+  // outstanding write transactions end; then switches to FS_DISABLED, which
+  // flushes the write-back buffer and unmounts the device. Returns true if
+  // the device got unmounted before the deadline. Otherwise, returns false
+  // at the deadline; if write transactions are still outstanding, the guard
+  // stays in FS_SHUTDOWN.
+  bool drain(Clock::time_point deadline);
+
+  // Requests all outstanding write transactions to stop at the next safe
+  // point (see WriteTransaction::shouldAbort()), without changing the mode.
+  // Called automatically when switching to FS_SHUTDOWN or FS_DISABLED.
+  void abortWriteTransactions();
+
   Mount mount(bool force = false);
+
+  // Like mount(), but if Device::mount() fails (e.g. because the card is not
+  // ready yet after power-up), keeps retrying with exponential backoff
+  // until the timeout. Concurrent requests share a single retry schedule,
+  // and are all granted once an attempt succeeds.
+  Mount mount(std::chrono::microseconds timeout, bool force = false);
+
   WriteTransaction write(bool force = false);
+  WriteTransaction write(WritePriority priority, bool force = false);
+
+  WriteBatch writeBatch(WritePriority priority = WRITE_PRIORITY_NORMAL,
+                        bool force = false);
+
+  // Acquires a Mount and a WriteTransaction at once, in a single critical
+  // section. Unlike creating the two separately, the result is never a
+  // mount that cannot be written to: if the write transaction is rejected,
+  // the mount is released, and the result is inactive.
+  WriteMount mountForWrite(bool force = false);
+  WriteMount mountForWrite(WritePriority priority, bool force = false);
+
+  // Requests the filesystem to be mounted, without blocking. If the device
+  // is already mounted, or the request is rejected, the callback is called
+  // immediately. Otherwise, mounting is performed by a task submitted to the
+  // executor, and the callback is called from that task. Concurrent
+  // requests share a single Device::mount() call.
+  void mountAsync(MountCallback callback, bool force = false);
+
+  // Configures the backoff between mount retries (see mount(timeout)): the
+  // first retry happens after initial_delay, and each subsequent delay is
+  // doubled, up to max_delay. Defaults to 10 ms and 1 s. An initial_delay
+  // of zero is rounded up to 1 us.
+  void setMountRetryBackoff(std::chrono::microseconds initial_delay,
+                            std::chrono::microseconds max_delay);
+
+  // Hints that the filesystem will be needed soon (e.g. a log rotation is
+  // scheduled): starts mounting the device in the background, via the
+  // executor, so that the upcoming Mount does not wait for Device::mount().
+  // In FS_EAGER_UNMOUNT, the idle filesystem is kept mounted for at least
+  // the grace period, and then unmounted by tick() if nobody has used it.
+  // Ignored in modes that reject non-forced mounts.
+  void prefetchMount(std::chrono::microseconds grace_period);
+
+  // If enabled, when the last Mount is destroyed and the device needs to be
+  // unmounted, Device::unmount() is left to a task submitted to the
+  // executor, so that destroying a Mount never waits for the device. If a
+  // new Mount arrives before the task runs, the unmount is cancelled.
+  // Disabled by default.
+  void setDeferredUnmount(bool deferred);
+
+  // Sets the listener to notify about state changes, or nullptr for none.
+  // Should be called before the guard is used.
+  void setListener(Listener* listener);
+
+  // Sets the buffer to record the guard's events to (see TraceBuffer), or
+  // nullptr for none. Should be called before the guard is used.
+  void setTrace(TraceBuffer* trace);
+
+  // Keeps track of clean unmounts in the specified state, placed in memory
+  // that survives resets: it is marked dirty before each Device::mount(),
+  // and clean after each Device::unmount(). Before the first mount, its
+  // previous value is passed to Device::setLastUnmountClean(). Should be
+  // called at boot, before the guard is used.
+  //
+  // Note that the guard never mounts the device at boot on its own: the
+  // first Mount that needs the device mounts it, so that startup does not
+  // wait for it if no file access is needed early. To mount in the
+  // background instead, use prefetchMount().
+  void setPersistentState(PersistentState* state);
+
+  // Sets the executor used by mountAsync(), prefetchMount(), and deferred
+  // unmounts. By default, each task is run in
+  // a new detached thread. The guard must outlive all submitted tasks.
+  void setExecutor(Executor executor);
 
   // Returns true if the underlying device is mounted; false otherwise.
-  // In FS_DISABLED mode, will always return true. In FS_NORMAL, may return
+  // In FS_DISABLED mode, will always return false. In FS_NORMAL, may return
   // true even if getPendingMountsCount() is zero.
   bool isMounted() const;
 
+  // Returns the current state of the underlying device. Never blocks.
+  MountState mountState() const;
+
+  // Returns true if the underlying device is mounted read-only (see
+  // Device::supportsReadOnlyMount()). Never blocks.
+  bool isMountedReadOnly() const;
+
+  // In FS_EAGER_UNMOUNT, keeps the filesystem mounted for the specified
+  // time after the last Mount object is destroyed, so that periodic
+  // accesses do not remount the device every time. The idle filesystem is
+  // then unmounted by tick(). Zero (the default) unmounts immediately.
+  void setUnmountDelay(std::chrono::microseconds delay);
+
+  // Like setUnmountDelay(), but the delay adapts to the observed idle time
+  // between consecutive uses: it is set to twice the (smoothed) idle time,
+  // clamped to [min_delay, max_delay]. If the idle time exceeds max_delay,
+  // lingering would not avoid remounts, so min_delay is used.
+  void setAdaptiveUnmountDelay(std::chrono::microseconds min_delay,
+                               std::chrono::microseconds max_delay);
+
+  // Enables coalescing of the writes made via WriteTransaction::write() in a
+  // RAM buffer of the specified capacity. Buffered data is flushed when the
+  // last write transaction ends, before the device gets unmounted, when the
+  // buffer fills up (in chunks whose sizes are multiples of alignment), and
+  // by tick() once it is older than max_age (zero means no age limit). Must
+  // be called before any write transactions are started.
+  void enableWriteBack(size_t capacity, size_t alignment,
+                       std::chrono::microseconds max_age);
+
+  // Writes the buffered data for the specified target, or for all targets if
+  // nullptr. Must be called before destroying a target that may have
+  // buffered data. Returns false if a write has failed, including writes of
+  // automatic flushes (on unmount, at the end of write transactions, or on
+  // expiry) that have not been reported yet.
+  bool flushWriteBack(WriteTarget* target = nullptr);
+
+  // Enables background maintenance: in FS_NORMAL, once the mounted
+  // filesystem has been idle (no Mount objects and no write transactions)
+  // for at least idle_threshold, tick() calls Device::maintain() with the
+  // specified time budget, until the device reports that it is done, or the
+  // idle period ends. Zero budget (the default) disables.
+  void setMaintenance(std::chrono::microseconds idle_threshold,
+                      std::chrono::microseconds budget);
+
+  // Unmounts the idle filesystem if its unmount delay has expired, flushes
+  // expired write-back data, and runs background maintenance. Should be
+  // called periodically when using an unmount delay, a write-back age
+  // limit, or maintenance.
+  void tick();
+
   // Returns the number of Mount objects for this guard object.
   int getPendingMountsCount() const;
 
   // Returns the number of write transactions for this guard object.
   int getPendingWriteTransactionsCount() const;
 
+  // Returns the number of write transactions of the specified priority.
+  int getPendingWriteTransactionsCount(WritePriority priority) const;
+
+  // Rejects new write transactions with priority lower than specified,
+  // unless forced. Defaults to WRITE_PRIORITY_LOW, i.e. admitting all. In
+  // FS_LAME_DUCK, where only forced writers are admitted, applies to the
+  // forced writers as well.
+  void setMinWritePriority(WritePriority priority);
+
+  // Limits the number of concurrent non-forced write transactions with the
+  // specified priority. Negative (the default) means no limit. In
+  // FS_LAME_DUCK, applies to the forced writers as well.
+  void setWriteQuota(WritePriority priority, int max_concurrent);
+
+  // Sheds low-priority writers as the supply level (e.g. voltage in mV)
+  // drops: thresholds[p] is the minimum supply level at which writers with
+  // priority p are admitted (should be non-increasing with p). Call
+  // reportSupplyLevel() to apply; if the level is below all the
+  // thresholds, all non-forced writers are rejected (in FS_LAME_DUCK, all
+  // writers).
+  void setSupplyThresholds(const int (&thresholds)[kWritePriorityCount]);
+  void reportSupplyLevel(int level);
+
+  // Limits the rate of writes, to protect the flash from wearing out: a
+  // token bucket holding up to burst_bytes, refilled at bytes_per_hour.
+  // Bytes reported by write transactions (see
+  // WriteTransaction::reportBytesWritten()) are taken from the bucket;
+  // when it is empty, new non-forced write transactions are rejected.
+  // Forced transactions are always admitted, but still charged. The bucket
+  // starts full. Zero bytes_per_hour (the default) disables the limit.
+  void setWriteBudget(uint64_t bytes_per_hour, uint64_t burst_bytes);
+
+  // Returns the number of bytes currently left in the write budget, or -1
+  // if the write budget is disabled.
+  int64_t getWriteBudget();
+
+  // Enables degrading on unhealthy media. The guard keeps a rolling window
+  // of the latencies and outcomes of Device::mount() and
+  // Device::remountReadWrite() calls; when any of the thresholds is
+  // crossed, it switches itself from FS_NORMAL or FS_EAGER_UNMOUNT to
+  // FS_LAME_DUCK, so that non-critical workloads stop hammering a slow or
+  // dying card, and only forced requests get through. The window is kept,
+  // so that healthScore() reflects the failures. The application may
+  // switch back, e.g. after the card has been replaced; that clears the
+  // window.
+  void setHealthThresholds(const HealthThresholds& thresholds);
+
+  // Returns the percentage, 0 to 100, of the recent device calls that have
+  // succeeded within the latency threshold (see setHealthThresholds()).
+  // 100 if there have been none.
+  int healthScore() const;
+
+  // Returns a snapshot of the performance counters. Requires
+  // ROO_POWERSAFEFS_STATS; otherwise, returns all zeros.
+  Stats stats() const;
+
  private:
   friend class Mount;
   friend class WriteTransaction;
+  friend class GuardGroup;
+  friend class ModeOverride;
+  friend class WriteMount;
+  friend class MaintenanceBudget;
 
   bool tryMount(bool forced);
   void unmount(bool forced);
 
-  bool tryBeginWriteTransaction(bool forced);
-  void endWriteTransaction(bool forced);
+  // The slow path of unmount(). Must be called with mutex_ held; may
+  // release it.
+  void unmountLocked(std::unique_lock<Mutex>& lock, bool forced);
+
+  // The slow path of tryMount(). If retry_deadline is
+  // Clock::time_point::min(), fails without retrying if a mount attempt
+  // fails after mount_failures_ was equal to mount_failures. Otherwise,
+  // retries according to the shared backoff schedule until the deadline.
+  // Dispatches the pending events before returning, whether it succeeds
+  // or not.
+  bool tryMountLocked(
+      std::unique_lock<Mutex>& lock, bool forced, uint32_t mount_failures,
+      Clock::time_point retry_deadline = Clock::time_point::min());
+
+  // The body of tryMountLocked(), without dispatching the events.
+  bool acquireMountLocked(std::unique_lock<Mutex>& lock, bool forced,
+                          uint32_t mount_failures,
+                          Clock::time_point retry_deadline);
+
+  // Executor task that resolves pending_async_mounts_.
+  void runAsyncMounts();
+
+  // Executor task that unmounts the device if still needed.
+  void runDeferredUnmount();
+
+  bool tryBeginWriteTransaction(WritePriority priority, bool forced);
+  void endWriteTransaction(WritePriority priority, bool forced);
+
+  // Must be called with mutex_ held; may release it for the duration of a
+  // read-write upgrade.
+  bool tryBeginWriteTransactionLocked(std::unique_lock<Mutex>& lock,
+                                      WritePriority priority, bool forced);
+
+  // Updates the write transaction counts. Must be called with mutex_ held.
+  // Returns the number of the remaining write transactions.
+  int releaseWriteTransactionLocked(WritePriority priority, bool forced);
+
+  // Releases a WriteMount.
+  void endWriteTransactionAndUnmount(WritePriority priority, bool forced);
+
+  // Called when the last write transaction has ended: queues
+  // EVENT_WRITES_FINISHED, and flushes the write-back buffer. Must be called
+  // with mutex_ held, in the same critical section that released the
+  // transaction; temporarily releases it for the flush.
+  void finishWriteTransactionsLocked(std::unique_lock<Mutex>& lock);
+
+  // Checks the priority threshold and quota. Must be called with mutex_
+  // held.
+  bool admitsWritePriority(Mode mode, WritePriority priority,
+                           bool forced) const;
+
+  // Refills the write budget bucket, and charges it with the bytes reported
+  // since the last update. Must be called with mutex_ held.
+  void updateWriteBudget(Clock::time_point now);
+
+  // Lock-free paths for acquiring and releasing a non-forced mount when the
+  // device is already mounted. Return false if the slow path (under mutex_)
+  // is needed.
+  bool tryMountFast();
+  bool tryUnmountFast();
+
+  // Brings the device to the state required by the current mode and counts,
+  // unless another thread is already in the middle of a device transition
+  // (in which case, that thread reconciles once done), and dispatches
+  // pending events. Must be called with mutex_ held; releases it for the
+  // duration of device calls and listener notifications.
+  void reconcile(std::unique_lock<Mutex>& lock);
+
+  enum EventType {
+    EVENT_MOUNTED,
+    EVENT_UNMOUNTED,
+    EVENT_MODE_CHANGED,
+    EVENT_WRITES_FINISHED
+  };
+
+  struct Event {
+    EventType type;
+    Mode mode;
+  };
+
+  // Queues an event for the listener, if any. Must be called with mutex_
+  // held.
+  void postEvent(EventType type);
+
+  // Delivers the queued events to the listener, with mutex_ released. If
+  // another thread is already delivering, leaves the events to it, so that
+  // the listener sees them in order.
+  void dispatchEvents(std::unique_lock<Mutex>& lock);
+
+  bool shouldUnmount(uint32_t state) const;
+  bool shouldRemount(uint32_t state) const;
+
+  // Calls device_->mount() with mutex_ released, and publishes the result.
+  bool deviceMount(std::unique_lock<Mutex>& lock);
+
+  // Records the outcome of a device call in the health window, and
+  // degrades the mode if the thresholds are crossed. Must be called with
+  // mutex_ held.
+  void recordDeviceCall(Clock::time_point start, bool ok);
+
+  // Atomically moves the device from FS_MOUNTED to FS_UNMOUNTING, provided
+  // that it should be unmounted. Fails if a Mount has been acquired via the
+  // fast path in the meantime.
+  bool beginUnmount();
+
+  // Calls device_->unmount() with mutex_ released, and publishes the result.
+  void finishUnmount(std::unique_lock<Mutex>& lock);
+
+  void trace(TraceEventType type, uint8_t arg) {
+    if (trace_ != nullptr) trace_->record(type, arg);
+  }
+
+  void setMountState(MountState mount_state);
+  void setReadOnly(bool read_only);
+
+  // True if the device is not in a transitional state, and no read-write
+  // upgrade is in progress.
+  bool isSettled() const;
+
+  // Waits, with mutex_ released, until the device is not in a transitional
+  // state. The second variant returns false if the deadline passes first.
+  void awaitSettled(std::unique_lock<Mutex>& lock);
+  bool awaitSettled(std::unique_lock<Mutex>& lock,
+                    Clock::time_point deadline);
+
+  // Sets the base mode, and updates the effective mode in state_. Must be
+  // called with mutex_ held. Returns false if the effective mode has not
+  // changed.
+  bool setModeLocked(Mode mode);
+
+  // Recomputes the effective mode from the base mode and the overrides,
+  // and updates it in state_. Must be called with mutex_ held. Returns
+  // false if the effective mode has not changed.
+  bool applyModeLocked();
+
+  // Adds or removes a mode override, and brings the device to the state
+  // required by the new effective mode.
+  void addModeOverride(ModeOverride* mode_override);
+  void removeModeOverride(ModeOverride* mode_override);
+
+  // The two halves of setMode(), used by GuardGroup to change the mode of
+  // several guards at once. updateMode() returns false if the mode has not
+  // changed.
+  bool updateMode(Mode mode);
+  void settle();
+
+  // Returns the current unmount delay in FS_EAGER_UNMOUNT.
+  std::chrono::microseconds unmountDelay() const;
+
+  // Called, under mutex_, when a Mount is granted while the filesystem is
+  // idle, and when it becomes idle, respectively.
+  void onIdleEnd(Clock::time_point now);
+  void onIdleStart(Clock::time_point now);
+
+  // Runs Device::maintain() if due. Called by tick() with mutex_ held;
+  // releases it for the duration of the call.
+  void maybeMaintain(std::unique_lock<Mutex>& lock);
+
+  // Records that the filesystem has been used, ending the current idle
+  // period as far as maintenance is concerned. No-op unless maintenance is
+  // enabled. Must be called with mutex_ held.
+  void noteActivity();
 
-  void unmountIfPending();
-  
   Device* device_;
-  mutable std::mutex mutex_;
+  mutable Mutex mutex_;
+
+  // Notified whenever a device transition completes.
+  ConditionVariable transition_cv_;
+
+  // Notified when the last write transaction ends.
+  ConditionVariable writes_cv_;
+
+  // Packed mode, mount state, and the count of Mount objects. Read without
+  // locking; modified with CAS. Changes of the mode and of the mount state
+  // additionally require mutex_.
+  std::atomic<uint32_t> state_;
+
+  // The mode set by setMode(). The effective mode, in state_, may differ
+  // due to overrides.
+  Mode base_mode_;
+
+  // The most recent active override, or nullptr if none.
+  ModeOverride* mode_overrides_;
+
+  // Incremented (under mutex_) on every failed Device::mount(). Lets the
+  // requests that waited for a mount attempt find out that it failed.
+  uint32_t mount_failures_;
+
+  // Shared mount retry schedule. The current delay is zero after a
+  // successful mount.
+  std::chrono::microseconds initial_retry_delay_;
+  std::chrono::microseconds max_retry_delay_;
+  std::chrono::microseconds retry_delay_;
+  Clock::time_point next_mount_retry_;
+
+  // Unmount delay configuration. If adaptive, min_unmount_delay_ is
+  // smaller than max_unmount_delay_.
+  std::chrono::microseconds min_unmount_delay_;
+  std::chrono::microseconds max_unmount_delay_;
+
+  // Smoothed idle time between consecutive uses of the filesystem.
+  std::chrono::microseconds avg_idle_time_;
+
+  // When the filesystem last became idle; or Clock::time_point::min() if it
+  // is in use.
+  Clock::time_point idle_since_;
+
+  // In FS_EAGER_UNMOUNT, the idle filesystem is not unmounted before that
+  // time.
+  Clock::time_point unmount_not_before_;
+
+  struct AsyncMountRequest {
+    MountCallback callback;
+    bool forced;
+  };
+
+  Executor executor_;
+  std::vector<AsyncMountRequest> pending_async_mounts_;
+  bool async_mount_scheduled_;
+
+  bool deferred_unmount_;
+  bool deferred_unmount_scheduled_;
+
+  // Set while Device::remountReadWrite() is in progress.
+  bool upgrading_;
+
+  // Maintenance configuration; disabled if the budget is zero.
+  std::chrono::microseconds maintenance_idle_threshold_;
+  std::chrono::microseconds maintenance_budget_;
+
+  // When the filesystem has last been used: a Mount or a write transaction
+  // has begun or ended under mutex_, or tick() has seen it in use.
+  Clock::time_point last_activity_;
+
+  // Set when Device::maintain() has reported being done since the last
+  // activity.
+  bool maintenance_done_;
+
+  // Set while Device::maintain() is in progress. Postpones unmounts.
+  bool maintaining_;
+
+  Listener* listener_;
+  TraceBuffer* trace_;
+
+  PersistentState* persistent_state_;
+
+  // Set until Device::setLastUnmountClean() has been called.
+  bool clean_hint_pending_;
+
+  std::vector<Event> pending_events_;
+  bool dispatching_events_;
+
+  std::unique_ptr<WriteBackBuffer> write_back_;
+
+  // The number of write-back flushes in progress after the last write
+  // transaction has ended. EVENT_WRITES_FINISHED is held back until they
+  // are done.
+  int write_back_flushes_;
+
+  HealthMonitor health_;
+  HealthThresholds health_thresholds_;
+  bool health_tracking_;
+
+  // Set once degraded on unhealthy media, until the application switches
+  // back to FS_NORMAL or FS_EAGER_UNMOUNT.
+  bool health_degraded_;
+
+#if ROO_POWERSAFEFS_STATS
+  StatsCollector stats_;
+#endif
 
-  Mode mode_;
-  bool mounted_;
-  int mount_count_;
   int forced_mount_count_;
-  int write_transaction_count_;
+  std::atomic<int> write_transaction_count_;
   int forced_write_transaction_count_;
+
+  // Incremented to signal outstanding write transactions to abort.
+  std::atomic<uint32_t> abort_epoch_;
+
+  // Admission control by write priority. A min_write_priority_ of
+  // kWritePriorityCount rejects all non-forced writers.
+  int min_write_priority_;
+  int write_quota_[kWritePriorityCount];
+  int write_transaction_count_by_priority_[kWritePriorityCount];
+  int supply_thresholds_[kWritePriorityCount];
+
+  // Write budget token bucket. Disabled if write_budget_rate_ is zero.
+  // Reported bytes are accumulated in write_budget_spent_ without locking,
+  // and taken from the bucket on the next update.
+  uint64_t write_budget_rate_;
+  uint64_t write_budget_burst_;
+  int64_t write_budget_tokens_;
+  Clock::time_point write_budget_updated_;
+  std::atomic<uint64_t> write_budget_spent_;
+};
+
+// Pins the guard's mode for as long as this object is alive, e.g. to keep
+// FS_NORMAL during a log compaction, so that it does not remount the
+// device for every file. Overrides stack: the most recent one wins, except
+// that they can only make FS_LAME_DUCK, FS_SHUTDOWN and FS_DISABLED
+// stricter, so that run-time protection (e.g. a drain on power loss) is
+// never weakened. Creating and destroying an override performs at most
+// one device transition, and mode changes made via setMode() in the
+// meantime are preserved. Typical usage scenario:
+//
+// {
+//   ModeOverride pin(&guard, Guard::FS_NORMAL);
+//   CompactLogs();
+// }
+class ModeOverride {
+ public:
+  ModeOverride(Guard* guard, Guard::Mode mode);
+  ~ModeOverride();
+
+  Guard::Mode mode() const { return mode_; }
+
+ private:
+  friend class Guard;
+
+  ModeOverride(const ModeOverride&) = delete;
+  ModeOverride& operator=(const ModeOverride&) = delete;
+
+  Guard* guard_;
+  Guard::Mode mode_;
+
+  // Intrusive list of the guard's overrides, most recent first.
+  ModeOverride* prev_;
+  ModeOverride* next_;
 };
 
 }  // namespace roo_powersafefs
\ No newline at end of file
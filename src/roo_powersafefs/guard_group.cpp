@@ -0,0 +1,68 @@
+#include "roo_powersafefs/guard_group.h"
+
+#include <algorithm>
+
+#if ROO_POWERSAFEFS_SYNC != ROO_POWERSAFEFS_SYNC_NONE
+#include <thread>
+#endif
+
+namespace roo_powersafefs {
+
+bool MultiMount::mounted() const {
+  if (mounts_.empty()) return false;
+  for (const Mount& mount : mounts_) {
+    if (!mount.mounted()) return false;
+  }
+  return true;
+}
+
+void GuardGroup::add(Guard* guard, int priority) {
+  guards_.push_back(Member{guard, priority});
+}
+
+void GuardGroup::setMode(Guard::Mode mode, TransitionOrder order) {
+  std::vector<Guard*> changed;
+  for (const Member& member : guards_) {
+    if (member.guard->updateMode(mode)) changed.push_back(member.guard);
+  }
+  if (changed.empty()) return;
+#if ROO_POWERSAFEFS_SYNC != ROO_POWERSAFEFS_SYNC_NONE
+  if (order == TRANSITION_PARALLEL) {
+    // The calling thread settles the last guard.
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i + 1 < changed.size(); ++i) {
+      threads.emplace_back([guard = changed[i]]() { guard->settle(); });
+    }
+    changed.back()->settle();
+    for (std::thread& thread : threads) thread.join();
+    return;
+  }
+#endif
+  // Without threads, TRANSITION_PARALLEL also settles in priority order.
+  std::vector<Member> sorted = guards_;
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const Member& a, const Member& b) {
+                     return a.priority > b.priority;
+                   });
+  for (const Member& member : sorted) {
+    if (std::find(changed.begin(), changed.end(), member.guard) !=
+        changed.end()) {
+      member.guard->settle();
+    }
+  }
+}
+
+MultiMount GuardGroup::mount(bool force) {
+  std::vector<size_t> order(guards_.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    return guards_[a].priority > guards_[b].priority;
+  });
+  std::vector<Mount> mounts(guards_.size());
+  for (size_t i : order) {
+    mounts[i] = Mount(guards_[i].guard, force);
+  }
+  return MultiMount(std::move(mounts));
+}
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "roo_powersafefs.h"
+
+namespace roo_powersafefs {
+
+// Combined handle holding Mounts on several guards. See GuardGroup::mount().
+class MultiMount {
+ public:
+  MultiMount() = default;
+  MultiMount(MultiMount&& other) = default;
+  MultiMount& operator=(MultiMount&& other) = default;
+
+  // Returns true if all the requested filesystems are mounted.
+  bool mounted() const;
+
+  // Returns true if the i-th filesystem (in the order in which guards have
+  // been added to the group) is mounted.
+  bool mounted(size_t i) const { return mounts_[i].mounted(); }
+
+  explicit operator bool() const { return mounted(); }
+
+  // Releases all mounts, leaving this object empty.
+  void reset() { mounts_.clear(); }
+
+ private:
+  friend class GuardGroup;
+  friend class PartitionedGuard;
+
+  MultiMount(std::vector<Mount> mounts) : mounts_(std::move(mounts)) {}
+
+  MultiMount(const MultiMount&) = delete;
+  MultiMount& operator=(const MultiMount&) = delete;
+
+  std::vector<Mount> mounts_;
+};
+
+// Set of guards, e.g. for an SD card, internal flash, and external SPI
+// flash, whose modes are changed together. Typical usage: on power loss,
+// call setMode(Guard::FS_SHUTDOWN) once, rather than for each guard.
+//
+// All guards must be added before the group is used.
+class GuardGroup {
+ public:
+  enum TransitionOrder {
+    // Each device is mounted or unmounted in a separate thread. With
+    // ROO_POWERSAFEFS_SYNC_NONE, same as TRANSITION_PRIORITY_ORDER.
+    TRANSITION_PARALLEL,
+
+    // Devices are mounted or unmounted one by one, in the order of
+    // decreasing priority.
+    TRANSITION_PRIORITY_ORDER
+  };
+
+  GuardGroup() = default;
+
+  // Adds the guard to the group.
+  void add(Guard* guard, int priority = 0);
+
+  size_t size() const { return guards_.size(); }
+
+  // Changes the mode of all guards. The new mode takes effect on all guards,
+  // i.e. applies to new mount and write transaction requests, before any
+  // device gets mounted or unmounted. Returns once all devices have
+  // settled.
+  void setMode(Guard::Mode mode, TransitionOrder order = TRANSITION_PARALLEL);
+
+  // Requests all filesystems to be mounted; they get mounted in the order
+  // of decreasing priority.
+  MultiMount mount(bool force = false);
+
+ private:
+  struct Member {
+    Guard* guard;
+    int priority;
+  };
+
+  GuardGroup(const GuardGroup&) = delete;
+  GuardGroup& operator=(const GuardGroup&) = delete;
+
+  // In the order of addition.
+  std::vector<Member> guards_;
+};
+
+}  // namespace roo_powersafefs
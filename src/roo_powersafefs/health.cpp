@@ -0,0 +1,61 @@
+#include "roo_powersafefs/health.h"
+
+#include <limits>
+
+namespace roo_powersafefs {
+
+HealthMonitor::HealthMonitor() : next_(0), count_(0) {}
+
+void HealthMonitor::record(std::chrono::microseconds latency, bool ok) {
+  int64_t us = latency.count();
+  if (us < 0) us = 0;
+  if (us > std::numeric_limits<uint32_t>::max()) {
+    us = std::numeric_limits<uint32_t>::max();
+  }
+  samples_[next_] = Sample{(uint32_t)us, ok};
+  next_ = (next_ + 1) % kWindowSize;
+  if (count_ < kWindowSize) ++count_;
+}
+
+void HealthMonitor::clear() {
+  next_ = 0;
+  count_ = 0;
+}
+
+int HealthMonitor::failurePercent() const {
+  if (count_ == 0) return 0;
+  int failures = 0;
+  for (int i = 0; i < count_; ++i) {
+    if (!samples_[i].ok) ++failures;
+  }
+  return failures * 100 / count_;
+}
+
+std::chrono::microseconds HealthMonitor::meanLatency() const {
+  if (count_ == 0) return std::chrono::microseconds(0);
+  uint64_t total = 0;
+  for (int i = 0; i < count_; ++i) total += samples_[i].latency_us;
+  return std::chrono::microseconds(total / count_);
+}
+
+int HealthMonitor::score(const HealthThresholds& thresholds) const {
+  if (count_ == 0) return 100;
+  uint64_t max_latency = thresholds.max_mean_latency.count();
+  int good = 0;
+  for (int i = 0; i < count_; ++i) {
+    if (samples_[i].ok &&
+        (max_latency == 0 || samples_[i].latency_us <= max_latency)) {
+      ++good;
+    }
+  }
+  return good * 100 / count_;
+}
+
+bool HealthMonitor::exceeds(const HealthThresholds& thresholds) const {
+  if (count_ == 0 || count_ < thresholds.min_samples) return false;
+  if (failurePercent() > thresholds.max_failure_percent) return true;
+  return thresholds.max_mean_latency.count() > 0 &&
+         meanLatency() > thresholds.max_mean_latency;
+}
+
+}  // namespace roo_powersafefs
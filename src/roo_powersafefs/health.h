@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace roo_powersafefs {
+
+// Limits on the device call outcomes, over the recent window, beyond which
+// a guard considers the media unhealthy. See Guard::setHealthThresholds().
+struct HealthThresholds {
+  // Do not judge the device until the window has at least that many
+  // samples.
+  int min_samples = 8;
+
+  // Maximum percentage of failed device calls.
+  int max_failure_percent = 25;
+
+  // Maximum mean latency of the device calls. Zero means no limit.
+  std::chrono::microseconds max_mean_latency = std::chrono::microseconds(0);
+};
+
+// Rolling window of the latencies and outcomes of the most recent device
+// calls. Not thread-safe; owned by a Guard, and used under its mutex.
+class HealthMonitor {
+ public:
+  static constexpr int kWindowSize = 16;
+
+  HealthMonitor();
+
+  void record(std::chrono::microseconds latency, bool ok);
+
+  // Forgets all samples.
+  void clear();
+
+  int sampleCount() const { return count_; }
+
+  // Percentage of failed calls in the window. Zero if empty.
+  int failurePercent() const;
+
+  // Mean latency of the calls in the window. Zero if empty.
+  std::chrono::microseconds meanLatency() const;
+
+  // Percentage, 0 to 100, of the calls in the window that have succeeded,
+  // and within the latency limit, if any. 100 if empty.
+  int score(const HealthThresholds& thresholds) const;
+
+  // Returns true if the window is full enough, and crosses any of the
+  // thresholds.
+  bool exceeds(const HealthThresholds& thresholds) const;
+
+ private:
+  struct Sample {
+    uint32_t latency_us;
+    bool ok;
+  };
+
+  Sample samples_[kWindowSize];
+  int next_;
+  int count_;
+};
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,44 @@
+#include "roo_powersafefs/partitioned_guard.h"
+
+#include <mutex>
+#include <utility>
+
+namespace roo_powersafefs {
+
+size_t PartitionedGuard::addPartition(Device* device, int priority) {
+  guards_.emplace_back(new Guard(device));
+  group_.add(guards_.back().get(), priority);
+  return guards_.size() - 1;
+}
+
+void PartitionedGuard::setMode(Guard::Mode mode,
+                               GuardGroup::TransitionOrder order) {
+  group_.setMode(mode, order);
+}
+
+void PartitionedGuard::prefetchMounts(std::chrono::microseconds grace_period) {
+  for (const std::unique_ptr<Guard>& guard : guards_) {
+    guard->prefetchMount(grace_period);
+  }
+}
+
+MultiMount PartitionedGuard::mountAll(bool force) {
+  Mutex mutex;
+  ConditionVariable resolved;
+  size_t pending = guards_.size();
+  std::vector<Mount> mounts(guards_.size());
+  for (size_t i = 0; i < guards_.size(); ++i) {
+    guards_[i]->mountAsync(
+        [&, i](Mount mount) {
+          std::lock_guard<Mutex> guard(mutex);
+          mounts[i] = std::move(mount);
+          if (--pending == 0) resolved.notify_all();
+        },
+        force);
+  }
+  std::unique_lock<Mutex> lock(mutex);
+  resolved.wait(lock, [&pending]() { return pending == 0; });
+  return MultiMount(std::move(mounts));
+}
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "roo_powersafefs.h"
+#include "roo_powersafefs/guard_group.h"
+
+namespace roo_powersafefs {
+
+// Set of partitions (e.g. logs, config, and blobs on the same flash), each
+// with its own device, managed together. Each partition is mounted lazily,
+// on first use, by a handle that names the partition; independent
+// partitions can also be mounted in parallel, e.g. at startup. Typical
+// usage scenario:
+//
+// enum { kLogs, kConfig };
+//
+// PartitionedGuard fs;
+// fs.addPartition(&logs_device);    // kLogs
+// fs.addPartition(&config_device);  // kConfig
+//
+// Mount mount = fs.mount(kConfig);
+// if (mount.mounted()) { ... }
+//
+// All partitions must be added before the object is used.
+class PartitionedGuard {
+ public:
+  PartitionedGuard() = default;
+
+  // Adds a partition, and returns its index. The device must outlive this
+  // object. The priority orders the partitions' mounts in mount() and
+  // mode changes in TRANSITION_PRIORITY_ORDER (see GuardGroup).
+  size_t addPartition(Device* device, int priority = 0);
+
+  size_t size() const { return guards_.size(); }
+
+  // The guard of the specified partition, e.g. for configuring it.
+  Guard& partition(size_t index) { return *guards_[index]; }
+  const Guard& partition(size_t index) const { return *guards_[index]; }
+
+  Mount mount(size_t index, bool force = false) {
+    return partition(index).mount(force);
+  }
+
+  WriteTransaction write(size_t index,
+                         WritePriority priority = WRITE_PRIORITY_NORMAL,
+                         bool force = false) {
+    return partition(index).write(priority, force);
+  }
+
+  WriteMount mountForWrite(size_t index,
+                           WritePriority priority = WRITE_PRIORITY_NORMAL,
+                           bool force = false) {
+    return partition(index).mountForWrite(priority, force);
+  }
+
+  // Changes the mode of all partitions. See GuardGroup::setMode().
+  void setMode(Guard::Mode mode, GuardGroup::TransitionOrder order =
+                                     GuardGroup::TRANSITION_PARALLEL);
+
+  // Starts mounting all partitions in the background, in parallel (using
+  // each guard's executor), without blocking. See Guard::prefetchMount().
+  void prefetchMounts(std::chrono::microseconds grace_period);
+
+  // Requests all partitions to be mounted, mounting them in parallel
+  // (using each guard's executor), and returns once all requests have been
+  // resolved.
+  MultiMount mountAll(bool force = false);
+
+ private:
+  PartitionedGuard(const PartitionedGuard&) = delete;
+  PartitionedGuard& operator=(const PartitionedGuard&) = delete;
+
+  std::vector<std::unique_ptr<Guard>> guards_;
+  GuardGroup group_;
+};
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+namespace roo_powersafefs {
+
+// State of a guard that survives resets, when placed in RTC or no-init
+// RAM. Records whether the device has been cleanly unmounted, so that,
+// after a reset, the next mount can skip expensive recovery. Plain data;
+// no initialization is needed, as garbage (e.g. after a power cycle) reads
+// as not clean. See Guard::setPersistentState().
+struct PersistentState {
+  static constexpr uint32_t kMagic = 0x50534650;
+  static constexpr uint32_t kCleanMarker = 0xC1EA0D0E;
+
+  // Returns true if the device has been cleanly unmounted, and not mounted
+  // since.
+  bool clean() const { return magic == kMagic && marker == kCleanMarker; }
+
+  void markClean() {
+    magic = kMagic;
+    marker = kCleanMarker;
+  }
+
+  void markDirty() {
+    magic = kMagic;
+    marker = 0;
+  }
+
+  uint32_t magic;
+  uint32_t marker;
+};
+
+}  // namespace roo_powersafefs
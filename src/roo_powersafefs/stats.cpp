@@ -0,0 +1,77 @@
+#include "roo_powersafefs/stats.h"
+
+namespace roo_powersafefs {
+
+int LatencyHistogram::Bucket(std::chrono::microseconds latency) {
+  int bucket = 0;
+  uint64_t us = latency.count() < 0 ? 0 : (uint64_t)latency.count();
+  while (us > 0 && bucket < kBucketCount - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+#if ROO_POWERSAFEFS_STATS
+
+namespace {
+
+template <typename Counter, int N>
+void Load(const Counter (&src)[N], uint32_t (&dst)[N]) {
+  for (int i = 0; i < N; ++i) {
+    dst[i] = src[i].load(std::memory_order_relaxed);
+  }
+}
+
+template <typename Counter, int N>
+void Clear(Counter (&counters)[N]) {
+  for (int i = 0; i < N; ++i) {
+    counters[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace
+
+StatsCollector::StatsCollector()
+    : cold_mounts_(0),
+      warm_mounts_(0),
+      mount_failures_(0),
+      unmounts_(0),
+      forced_mounts_(0),
+      forced_write_transactions_(0),
+      write_transactions_(0),
+      shed_write_transactions_(0),
+      over_budget_write_transactions_(0) {
+  Clear(rejected_mounts_);
+  Clear(rejected_write_transactions_);
+  Clear(device_mount_latency_);
+  Clear(device_unmount_latency_);
+  Clear(write_transaction_duration_);
+}
+
+Stats StatsCollector::snapshot() const {
+  Stats stats;
+  stats.cold_mounts = cold_mounts_.load(std::memory_order_relaxed);
+  stats.warm_mounts = warm_mounts_.load(std::memory_order_relaxed);
+  stats.mount_failures = mount_failures_.load(std::memory_order_relaxed);
+  stats.unmounts = unmounts_.load(std::memory_order_relaxed);
+  stats.forced_mounts = forced_mounts_.load(std::memory_order_relaxed);
+  stats.forced_write_transactions =
+      forced_write_transactions_.load(std::memory_order_relaxed);
+  stats.write_transactions =
+      write_transactions_.load(std::memory_order_relaxed);
+  stats.shed_write_transactions =
+      shed_write_transactions_.load(std::memory_order_relaxed);
+  stats.over_budget_write_transactions =
+      over_budget_write_transactions_.load(std::memory_order_relaxed);
+  Load(rejected_mounts_, stats.rejected_mounts);
+  Load(rejected_write_transactions_, stats.rejected_write_transactions);
+  Load(device_mount_latency_, stats.device_mount_latency.buckets);
+  Load(device_unmount_latency_, stats.device_unmount_latency.buckets);
+  Load(write_transaction_duration_, stats.write_transaction_duration.buckets);
+  return stats;
+}
+
+#endif  // ROO_POWERSAFEFS_STATS
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Set to 1 to collect per-guard performance counters. When 0 (the default),
+// the collection code is compiled out, and Guard::stats() returns zeros.
+#ifndef ROO_POWERSAFEFS_STATS
+#define ROO_POWERSAFEFS_STATS 0
+#endif
+
+namespace roo_powersafefs {
+
+// Number of Guard::Mode values.
+static constexpr int kModeCount = 5;
+
+// Latency histogram with fixed, power-of-two buckets. Bucket 0 counts
+// latencies below 1 us; bucket i > 0 counts latencies in [2^(i-1), 2^i) us;
+// the last bucket also counts everything longer.
+struct LatencyHistogram {
+  static constexpr int kBucketCount = 24;
+
+  // Returns the bucket index for the specified latency.
+  static int Bucket(std::chrono::microseconds latency);
+
+  uint32_t buckets[kBucketCount];
+};
+
+// Snapshot of the performance counters of a guard.
+struct Stats {
+  // Mount requests that have been granted after calling Device::mount().
+  uint32_t cold_mounts;
+
+  // Mount requests that have been granted with the device already mounted
+  // (including the ones that waited for another request's Device::mount()).
+  uint32_t warm_mounts;
+
+  // Number of failed Device::mount() calls.
+  uint32_t mount_failures;
+
+  // Number of Device::unmount() calls.
+  uint32_t unmounts;
+
+  // Forced mount and write transaction requests.
+  uint32_t forced_mounts;
+  uint32_t forced_write_transactions;
+
+  // Granted write transactions.
+  uint32_t write_transactions;
+
+  // Write transactions rejected by priority-based admission control.
+  uint32_t shed_write_transactions;
+
+  // Write transactions rejected because the write budget was exhausted.
+  uint32_t over_budget_write_transactions;
+
+  // Requests rejected because of the mode, indexed by Guard::Mode.
+  // Write transactions rejected because the device was not mounted are
+  // counted under the current mode as well.
+  uint32_t rejected_mounts[kModeCount];
+  uint32_t rejected_write_transactions[kModeCount];
+
+  LatencyHistogram device_mount_latency;
+  LatencyHistogram device_unmount_latency;
+  LatencyHistogram write_transaction_duration;
+};
+
+#if ROO_POWERSAFEFS_STATS
+
+// Lock-free collector of the counters in Stats. All updates use relaxed
+// atomic increments.
+class StatsCollector {
+ public:
+  StatsCollector();
+
+  void countColdMount() { inc(cold_mounts_); }
+  void countWarmMount() { inc(warm_mounts_); }
+  void countMountFailure() { inc(mount_failures_); }
+  void countUnmount() { inc(unmounts_); }
+  void countForcedMount() { inc(forced_mounts_); }
+  void countForcedWriteTransaction() { inc(forced_write_transactions_); }
+  void countWriteTransaction() { inc(write_transactions_); }
+  void countShedWriteTransaction() { inc(shed_write_transactions_); }
+  void countOverBudgetWriteTransaction() {
+    inc(over_budget_write_transactions_);
+  }
+  void countRejectedMount(int mode) { inc(rejected_mounts_[mode]); }
+  void countRejectedWriteTransaction(int mode) {
+    inc(rejected_write_transactions_[mode]);
+  }
+
+  void recordDeviceMountLatency(std::chrono::microseconds latency) {
+    record(device_mount_latency_, latency);
+  }
+  void recordDeviceUnmountLatency(std::chrono::microseconds latency) {
+    record(device_unmount_latency_, latency);
+  }
+  void recordWriteTransactionDuration(std::chrono::microseconds duration) {
+    record(write_transaction_duration_, duration);
+  }
+
+  Stats snapshot() const;
+
+ private:
+  using Counter = std::atomic<uint32_t>;
+  using Histogram = Counter[LatencyHistogram::kBucketCount];
+
+  static void inc(Counter& counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void record(Histogram& histogram,
+                     std::chrono::microseconds latency) {
+    inc(histogram[LatencyHistogram::Bucket(latency)]);
+  }
+
+  Counter cold_mounts_;
+  Counter warm_mounts_;
+  Counter mount_failures_;
+  Counter unmounts_;
+  Counter forced_mounts_;
+  Counter forced_write_transactions_;
+  Counter write_transactions_;
+  Counter shed_write_transactions_;
+  Counter over_budget_write_transactions_;
+  Counter rejected_mounts_[kModeCount];
+  Counter rejected_write_transactions_[kModeCount];
+  Histogram device_mount_latency_;
+  Histogram device_unmount_latency_;
+  Histogram write_transaction_duration_;
+};
+
+#endif  // ROO_POWERSAFEFS_STATS
+
+}  // namespace roo_powersafefs
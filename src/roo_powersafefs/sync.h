@@ -0,0 +1,225 @@
+#pragma once
+
+// Selects the synchronization primitives used by guards and write-back
+// buffers. Set ROO_POWERSAFEFS_SYNC to one of:
+//
+// ROO_POWERSAFEFS_SYNC_STD (default): std::mutex and
+//   std::condition_variable.
+//
+// ROO_POWERSAFEFS_SYNC_NONE: no-op primitives, for single-core targets
+//   without an RTOS. All guard operations must then be called from a single
+//   thread (and never from Device callbacks), so that nobody ever needs to
+//   wait. Tasks submitted by the guard (e.g. for mountAsync()) run inline.
+//
+// ROO_POWERSAFEFS_SYNC_FREERTOS: native FreeRTOS primitives (e.g. on
+//   ESP-IDF), bypassing the pthread emulation. The mutex is a FreeRTOS
+//   mutex, with priority inheritance, so that a high-priority task waiting
+//   for the guard boosts a low-priority one holding it. Condition
+//   variables block on a binary semaphore per waiting task, so the task
+//   notifications stay free for the application. Requires
+//   configSUPPORT_STATIC_ALLOCATION.
+
+#define ROO_POWERSAFEFS_SYNC_STD 0
+#define ROO_POWERSAFEFS_SYNC_NONE 1
+#define ROO_POWERSAFEFS_SYNC_FREERTOS 2
+
+#ifndef ROO_POWERSAFEFS_SYNC
+#define ROO_POWERSAFEFS_SYNC ROO_POWERSAFEFS_SYNC_STD
+#endif
+
+#if ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_STD
+#include <condition_variable>
+#include <mutex>
+#elif ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_NONE
+#include <mutex>
+#elif ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_FREERTOS
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#else
+#error "Unsupported ROO_POWERSAFEFS_SYNC"
+#endif
+
+namespace roo_powersafefs {
+
+#if ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_STD
+
+using Mutex = std::mutex;
+using ConditionVariable = std::condition_variable;
+
+#elif ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_NONE
+
+class Mutex {
+ public:
+  Mutex() = default;
+
+  void lock() {}
+  void unlock() {}
+  bool try_lock() { return true; }
+
+ private:
+  Mutex(const Mutex&) = delete;
+  Mutex& operator=(const Mutex&) = delete;
+};
+
+// In a single thread, the awaited condition can never change while
+// waiting, so the waits return immediately.
+class ConditionVariable {
+ public:
+  ConditionVariable() = default;
+
+  void notify_one() {}
+  void notify_all() {}
+
+  void wait(std::unique_lock<Mutex>& lock) {}
+
+  template <typename Predicate>
+  void wait(std::unique_lock<Mutex>& lock, Predicate pred) {}
+
+  template <typename TimePoint>
+  void wait_until(std::unique_lock<Mutex>& lock, const TimePoint& deadline) {}
+
+  template <typename TimePoint, typename Predicate>
+  bool wait_until(std::unique_lock<Mutex>& lock, const TimePoint& deadline,
+                  Predicate pred) {
+    return pred();
+  }
+
+ private:
+  ConditionVariable(const ConditionVariable&) = delete;
+  ConditionVariable& operator=(const ConditionVariable&) = delete;
+};
+
+#elif ROO_POWERSAFEFS_SYNC == ROO_POWERSAFEFS_SYNC_FREERTOS
+
+class Mutex {
+ public:
+  Mutex() : handle_(xSemaphoreCreateMutexStatic(&buffer_)) {}
+  ~Mutex() { vSemaphoreDelete(handle_); }
+
+  void lock() { xSemaphoreTake(handle_, portMAX_DELAY); }
+  void unlock() { xSemaphoreGive(handle_); }
+  bool try_lock() { return xSemaphoreTake(handle_, 0) == pdTRUE; }
+
+ private:
+  Mutex(const Mutex&) = delete;
+  Mutex& operator=(const Mutex&) = delete;
+
+  StaticSemaphore_t buffer_;
+  SemaphoreHandle_t handle_;
+};
+
+// Keeps a list of the waiting tasks, each blocked on its own binary
+// semaphore (on its stack), and wakes them up by giving it. A wakeup given
+// between releasing the lock and blocking is not lost, as the semaphore
+// stays given until taken. The semaphore is deleted once the wait is over,
+// so a wakeup that races with a timeout leaves nothing behind.
+class ConditionVariable {
+ public:
+  ConditionVariable() : waiters_(nullptr) {}
+
+  void notify_one() {
+    std::lock_guard<Mutex> guard(waiters_mutex_);
+    if (waiters_ != nullptr) wake(waiters_);
+  }
+
+  void notify_all() {
+    std::lock_guard<Mutex> guard(waiters_mutex_);
+    while (waiters_ != nullptr) wake(waiters_);
+  }
+
+  void wait(std::unique_lock<Mutex>& lock) { waitTicks(lock, portMAX_DELAY); }
+
+  template <typename Predicate>
+  void wait(std::unique_lock<Mutex>& lock, Predicate pred) {
+    while (!pred()) wait(lock);
+  }
+
+  template <typename TimePoint>
+  std::cv_status wait_until(std::unique_lock<Mutex>& lock,
+                            const TimePoint& deadline) {
+    auto now = TimePoint::clock::now();
+    if (now >= deadline) return std::cv_status::timeout;
+    // Rounds up, so that we don't wake up before the deadline.
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      deadline - now)
+                      .count();
+    uint64_t ticks = (us * configTICK_RATE_HZ + 999999) / 1000000;
+    waitTicks(lock, ticks < portMAX_DELAY ? (TickType_t)ticks
+                                          : portMAX_DELAY - 1);
+    return TimePoint::clock::now() >= deadline ? std::cv_status::timeout
+                                               : std::cv_status::no_timeout;
+  }
+
+  template <typename TimePoint, typename Predicate>
+  bool wait_until(std::unique_lock<Mutex>& lock, const TimePoint& deadline,
+                  Predicate pred) {
+    while (!pred()) {
+      if (wait_until(lock, deadline) == std::cv_status::timeout) {
+        return pred();
+      }
+    }
+    return true;
+  }
+
+ private:
+  struct Waiter {
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t semaphore;
+    Waiter* next;
+  };
+
+  ConditionVariable(const ConditionVariable&) = delete;
+  ConditionVariable& operator=(const ConditionVariable&) = delete;
+
+  // Removes the waiter from the list, and wakes up its task. Must be
+  // called with waiters_mutex_ held.
+  void wake(Waiter* waiter) {
+    remove(waiter);
+    xSemaphoreGive(waiter->semaphore);
+  }
+
+  // Must be called with waiters_mutex_ held.
+  void remove(Waiter* waiter) {
+    for (Waiter** w = &waiters_; *w != nullptr; w = &(*w)->next) {
+      if (*w == waiter) {
+        *w = waiter->next;
+        return;
+      }
+    }
+  }
+
+  void waitTicks(std::unique_lock<Mutex>& lock, TickType_t ticks) {
+    Waiter waiter;
+    waiter.semaphore = xSemaphoreCreateBinaryStatic(&waiter.buffer);
+    waiter.next = nullptr;
+    {
+      // Appends, so that notify_one() wakes up the longest waiting task.
+      std::lock_guard<Mutex> guard(waiters_mutex_);
+      Waiter** w = &waiters_;
+      while (*w != nullptr) w = &(*w)->next;
+      *w = &waiter;
+    }
+    lock.unlock();
+    xSemaphoreTake(waiter.semaphore, ticks);
+    {
+      // No-op if woken up; needed after a timeout. Also makes sure that a
+      // concurrent wake() is done with the semaphore before it is deleted.
+      std::lock_guard<Mutex> guard(waiters_mutex_);
+      remove(&waiter);
+    }
+    vSemaphoreDelete(waiter.semaphore);
+    lock.lock();
+  }
+
+  Mutex waiters_mutex_;
+  Waiter* waiters_;
+};
+
+#endif
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,50 @@
+#include "roo_powersafefs/trace.h"
+
+#include <chrono>
+
+namespace roo_powersafefs {
+
+void TraceBuffer::init() {
+  if (magic == kMagic) {
+    ++boot_count;
+    return;
+  }
+  boot_count = 0;
+  next.store(0, std::memory_order_relaxed);
+  for (uint32_t i = 0; i < kCapacity; ++i) {
+    events[i].timestamp_us.store(0, std::memory_order_relaxed);
+    events[i].info.store(0, std::memory_order_relaxed);
+  }
+  magic = kMagic;
+}
+
+void TraceBuffer::record(TraceEventType type, uint8_t arg) {
+  uint32_t now =
+      (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+  uint32_t index = next.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = events[index & (kCapacity - 1)];
+  slot.timestamp_us.store(now, std::memory_order_relaxed);
+  slot.info.store((boot_count & 0xFFFF) | ((uint32_t)type << 16) |
+                      ((uint32_t)arg << 24),
+                  std::memory_order_relaxed);
+}
+
+int TraceBuffer::read(TraceEvent* out, int max_events) const {
+  uint32_t end = next.load(std::memory_order_acquire);
+  uint32_t count = end < kCapacity ? end : kCapacity;
+  if (max_events < 0) max_events = 0;
+  if (count > (uint32_t)max_events) count = max_events;
+  for (uint32_t i = 0; i < count; ++i) {
+    const Slot& slot = events[(end - count + i) & (kCapacity - 1)];
+    uint32_t info = slot.info.load(std::memory_order_relaxed);
+    out[i] = TraceEvent{slot.timestamp_us.load(std::memory_order_relaxed),
+                        (uint16_t)(info & 0xFFFF),
+                        (TraceEventType)((info >> 16) & 0xFF),
+                        (uint8_t)(info >> 24)};
+  }
+  return count;
+}
+
+}  // namespace roo_powersafefs
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Number of events kept by a TraceBuffer. Must be a power of two.
+#ifndef ROO_POWERSAFEFS_TRACE_CAPACITY
+#define ROO_POWERSAFEFS_TRACE_CAPACITY 64
+#endif
+
+namespace roo_powersafefs {
+
+enum TraceEventType : uint8_t {
+  TRACE_NONE,
+
+  // A Mount has been granted or rejected, or released. The argument is 1
+  // if forced.
+  TRACE_MOUNT,
+  TRACE_MOUNT_REJECTED,
+  TRACE_UNMOUNT,
+
+  // The mode has changed. The argument is the new Guard::Mode.
+  TRACE_SET_MODE,
+
+  // Device::mount() (or mountReadOnly()) is about to be called, and has
+  // returned, respectively. For the end event, bit 0 of the argument is set
+  // if the device has been mounted, and bit 1 if read-only.
+  TRACE_DEVICE_MOUNT_BEGIN,
+  TRACE_DEVICE_MOUNT_END,
+
+  // Device::unmount() is about to be called, and has returned.
+  TRACE_DEVICE_UNMOUNT_BEGIN,
+  TRACE_DEVICE_UNMOUNT_END,
+
+  // A write transaction has been admitted, rejected, or has ended. The
+  // argument is the WritePriority.
+  TRACE_WRITE_BEGIN,
+  TRACE_WRITE_REJECTED,
+  TRACE_WRITE_END
+};
+
+struct TraceEvent {
+  // Low 32 bits of the steady clock, in microseconds.
+  uint32_t timestamp_us;
+
+  // TraceBuffer::boot() at the time of the event, truncated.
+  uint16_t boot;
+
+  TraceEventType type;
+  uint8_t arg;
+};
+
+// Fixed-size, lock-free ring buffer of the most recent guard events, for
+// reconstructing what happened before a crash or a brownout. Plain data,
+// so that it can be placed in RTC or no-init RAM, which survives resets.
+// Typical usage:
+//
+// RTC_NOINIT_ATTR TraceBuffer trace;
+//
+// void setup() {
+//   trace.init();
+//   // Dump the events from before the reset, e.g. using read().
+//   guard.setTrace(&trace);
+// }
+//
+// Recording an event takes an atomic increment, a clock read, and two
+// relaxed atomic stores. Concurrent recording is race-free, but an event
+// may come out torn if read() runs concurrently, or if the ring wraps
+// around while it is being recorded, so that another recorder overwrites
+// the same slot.
+struct TraceBuffer {
+  static constexpr uint32_t kMagic = 0x50534654;
+  static constexpr uint32_t kCapacity = ROO_POWERSAFEFS_TRACE_CAPACITY;
+
+  static_assert((kCapacity & (kCapacity - 1)) == 0,
+                "ROO_POWERSAFEFS_TRACE_CAPACITY must be a power of two");
+
+  // Must be called once after reset, before use. If the buffer holds a
+  // trace from before the reset, keeps it, and increments the boot count.
+  // Otherwise, clears the buffer.
+  void init();
+
+  // Appends an event, overwriting the oldest one if full.
+  void record(TraceEventType type, uint8_t arg);
+
+  // Number of times init() has found a preexisting trace.
+  uint32_t boot() const { return boot_count; }
+
+  // Copies up to max_events most recent events to the output, oldest first.
+  // Returns the number of events copied.
+  int read(TraceEvent* out, int max_events) const;
+
+  uint32_t magic;
+  uint32_t boot_count;
+
+  // Total number of events recorded. The next event goes to
+  // events[next % kCapacity].
+  std::atomic<uint32_t> next;
+
+  // A TraceEvent, as two words, so that the slots can be written with
+  // (lock-free, even on 32-bit targets) atomic stores.
+  struct Slot {
+    std::atomic<uint32_t> timestamp_us;
+
+    // Bits 0-15: boot, 16-23: type, 24-31: arg.
+    std::atomic<uint32_t> info;
+  };
+
+  Slot events[kCapacity];
+};
+
+}  // namespace roo_powersafefs
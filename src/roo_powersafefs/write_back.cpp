@@ -0,0 +1,132 @@
+#include "roo_powersafefs/write_back.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace roo_powersafefs {
+
+WriteBackBuffer::WriteBackBuffer(size_t capacity, size_t alignment,
+                                 std::chrono::microseconds max_age)
+    : capacity_(capacity),
+      alignment_(alignment == 0 ? 1 : alignment),
+      max_age_(max_age),
+      size_(0) {}
+
+bool WriteBackBuffer::write(WriteTarget* target, const void* data,
+                            size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  auto append = [&]() {
+    if (size_ + size > capacity_) return false;
+    if (size_ == 0) oldest_ = std::chrono::steady_clock::now();
+    size_ += size;
+    for (Entry& entry : entries_) {
+      if (entry.target == target) {
+        entry.data.insert(entry.data.end(), bytes, bytes + size);
+        return true;
+      }
+    }
+    entries_.push_back(
+        Entry{target, std::vector<uint8_t>(bytes, bytes + size)});
+    return true;
+  };
+  {
+    std::lock_guard<Mutex> lock(mutex_);
+    if (append()) return !takeErrorLocked(target);
+  }
+  std::lock_guard<Mutex> flush_lock(flush_mutex_);
+  flushLocked(nullptr, FLUSH_ALIGNED);
+  {
+    std::lock_guard<Mutex> lock(mutex_);
+    if (append()) return !takeErrorLocked(target);
+  }
+  // Does not fit even after the flush; write through, preserving the order
+  // of the data for that target.
+  flushLocked(target, FLUSH_ALL);
+  bool ok = target->write(bytes, size);
+  std::lock_guard<Mutex> lock(mutex_);
+  return !takeErrorLocked(target) && ok;
+}
+
+bool WriteBackBuffer::flush() {
+  std::lock_guard<Mutex> flush_lock(flush_mutex_);
+  flushLocked(nullptr, FLUSH_ALL);
+  std::lock_guard<Mutex> lock(mutex_);
+  return !takeErrorLocked(nullptr);
+}
+
+bool WriteBackBuffer::flush(WriteTarget* target) {
+  std::lock_guard<Mutex> flush_lock(flush_mutex_);
+  flushLocked(target, FLUSH_ALL);
+  std::lock_guard<Mutex> lock(mutex_);
+  return !takeErrorLocked(target);
+}
+
+void WriteBackBuffer::flushRetainingErrors() {
+  std::lock_guard<Mutex> flush_lock(flush_mutex_);
+  flushLocked(nullptr, FLUSH_ALL);
+}
+
+void WriteBackBuffer::flushIfExpired() {
+  {
+    std::lock_guard<Mutex> lock(mutex_);
+    if (size_ == 0 || max_age_.count() == 0 ||
+        std::chrono::steady_clock::now() - oldest_ < max_age_) {
+      return;
+    }
+  }
+  flushRetainingErrors();
+}
+
+size_t WriteBackBuffer::size() const {
+  std::lock_guard<Mutex> lock(mutex_);
+  return size_;
+}
+
+void WriteBackBuffer::flushLocked(WriteTarget* target, FlushScope scope) {
+  std::vector<Entry> flushed;
+  {
+    std::lock_guard<Mutex> lock(mutex_);
+    auto i = entries_.begin();
+    while (i != entries_.end()) {
+      size_t count = i->data.size();
+      if (scope == FLUSH_ALIGNED) count -= count % alignment_;
+      if ((target != nullptr && i->target != target) || count == 0) {
+        ++i;
+        continue;
+      }
+      size_ -= count;
+      if (count == i->data.size()) {
+        flushed.push_back(std::move(*i));
+        i = entries_.erase(i);
+      } else {
+        flushed.push_back(Entry{
+            i->target,
+            std::vector<uint8_t>(i->data.begin(), i->data.begin() + count)});
+        i->data.erase(i->data.begin(), i->data.begin() + count);
+        ++i;
+      }
+    }
+  }
+  for (const Entry& entry : flushed) {
+    if (entry.target->write(entry.data.data(), entry.data.size())) continue;
+    std::lock_guard<Mutex> lock(mutex_);
+    if (std::find(failed_.begin(), failed_.end(), entry.target) ==
+        failed_.end()) {
+      failed_.push_back(entry.target);
+    }
+  }
+}
+
+bool WriteBackBuffer::takeErrorLocked(WriteTarget* target) {
+  if (target == nullptr) {
+    bool failed = !failed_.empty();
+    failed_.clear();
+    return failed;
+  }
+  auto i = std::find(failed_.begin(), failed_.end(), target);
+  if (i == failed_.end()) return false;
+  failed_.erase(i);
+  return true;
+}
+
+}  // namespace roo_powersafefs
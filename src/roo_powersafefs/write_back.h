@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "roo_powersafefs/sync.h"
+
+namespace roo_powersafefs {
+
+// Destination of buffered writes, such as an open file.
+class WriteTarget {
+ public:
+  virtual ~WriteTarget() {}
+
+  // Writes the data to the underlying storage. Returns false on error.
+  virtual bool write(const uint8_t* data, size_t size) = 0;
+};
+
+// RAM buffer that coalesces small writes, possibly coming from many
+// concurrent write transactions, into few large writes. Data is kept per
+// target, in the order of appends. Flushes triggered by the size threshold
+// write chunks whose sizes are multiples of the alignment, keeping the
+// remainder buffered; full flushes write everything.
+//
+// Failed writes of buffered data are remembered per target, and reported
+// (once) by the next write() or flush() that covers the target, so that
+// no failure is lost, even if it happens in an automatic flush.
+//
+// Owned by a Guard; see Guard::enableWriteBack().
+class WriteBackBuffer {
+ public:
+  WriteBackBuffer(size_t capacity, size_t alignment,
+                  std::chrono::microseconds max_age);
+
+  // Buffers the data destined for the specified target. If the buffer
+  // fills up, flushes aligned chunks first. Data larger than the capacity
+  // is written through. Returns false if a write of data for this target
+  // has failed, now or in an earlier flush, not yet reported.
+  bool write(WriteTarget* target, const void* data, size_t size);
+
+  // Writes all buffered data. Returns false if a write for any target has
+  // failed, now or in an earlier flush, not yet reported.
+  bool flush();
+
+  // Writes all data buffered for the specified target. Must be called
+  // before the target is destroyed. Returns false if a write for the
+  // target has failed, now or in an earlier flush, not yet reported.
+  bool flush(WriteTarget* target);
+
+  // Writes all buffered data, leaving the failures to be reported later,
+  // by write() or flush(). Used for automatic flushes, which have nobody to
+  // report to.
+  void flushRetainingErrors();
+
+  // Like flushRetainingErrors(), but only if the oldest buffered data is
+  // older than max_age.
+  void flushIfExpired();
+
+  // Returns the number of buffered bytes.
+  size_t size() const;
+
+ private:
+  struct Entry {
+    WriteTarget* target;
+    std::vector<uint8_t> data;
+  };
+
+  enum FlushScope { FLUSH_ALL, FLUSH_ALIGNED };
+
+  // Writes the buffered data of the specified target (or of all targets, if
+  // target is nullptr), recording failures. Must be called with
+  // flush_mutex_ held.
+  void flushLocked(WriteTarget* target, FlushScope scope);
+
+  // Returns true if a failure has been recorded for the specified target
+  // (or for any target, if nullptr), and clears it. Must be called with
+  // mutex_ held.
+  bool takeErrorLocked(WriteTarget* target);
+
+  const size_t capacity_;
+  const size_t alignment_;
+  const std::chrono::microseconds max_age_;
+
+  // Serializes flushes, so that data for each target is written in order.
+  // Acquired before mutex_. Not held by appends that fit in the buffer.
+  Mutex flush_mutex_;
+
+  // Protects the fields below.
+  mutable Mutex mutex_;
+
+  std::vector<Entry> entries_;
+  size_t size_;
+
+  // When the oldest buffered data has been appended.
+  std::chrono::steady_clock::time_point oldest_;
+
+  // Targets with failed writes, not yet reported.
+  std::vector<WriteTarget*> failed_;
+};
+
+}  // namespace roo_powersafefs